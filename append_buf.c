@@ -1,13 +1,54 @@
 #include "append_buf.h"
+#include <errno.h>
 
-void ab_free(struct abuf *ab) { free(ab->b); }
+void ab_free(struct abuf *ab) {
+  free(ab->b);
+  ab->b = NULL;
+  ab->len = ab->cap = 0;
+}
 
-void ab_append(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) {
-    return;
+void ab_reset(struct abuf *ab) { ab->len = 0; }
+
+/* Makes room for len more bytes and returns where they go, or NULL if memory
+ * ran out. */
+char *ab_extend(struct abuf *ab, size_t len) {
+  if (ab->len + len > ab->cap) {
+    size_t cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) {
+      cap *= 2;
+    }
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) {
+      return NULL;
+    }
+    ab->b = new;
+    ab->cap = cap;
   }
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  char *at = &ab->b[ab->len];
   ab->len += len;
+  return at;
+}
+
+void ab_append(struct abuf *ab, const char *s, size_t len) {
+  char *at = ab_extend(ab, len);
+  if (at == NULL) {
+    return;
+  }
+  memcpy(at, s, len);
+}
+
+/* Writes the whole buffer, retrying short writes. */
+int ab_write(struct abuf *ab, int fd) {
+  size_t done = 0;
+  while (done < ab->len) {
+    ssize_t n = write(fd, &ab->b[done], ab->len - done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
 }
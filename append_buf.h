@@ -1,3 +1,6 @@
+#ifndef APPEND_BUF
+#define APPEND_BUF
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,12 +8,20 @@
 #include <termios.h>
 #include <unistd.h>
 #define ABUF_INIT                                                              \
-  { NULL, 0 }
+  { NULL, 0, 0 }
 
+/* A buffer meant to be kept and reused: ab_reset() empties it without giving
+ * the memory back, and it grows by doubling. */
 struct abuf {
   char *b;
-  int len;
+  size_t len;
+  size_t cap;
 };
 
 void ab_free(struct abuf *ab);
-void ab_append(struct abuf *ab, const char *s, int len);
+void ab_reset(struct abuf *ab);
+char *ab_extend(struct abuf *ab, size_t len);
+void ab_append(struct abuf *ab, const char *s, size_t len);
+int ab_write(struct abuf *ab, int fd);
+
+#endif
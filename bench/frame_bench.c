@@ -0,0 +1,49 @@
+#include "../editor.h"
+
+/* Times building frames the way refresh_screen does, without writing them:
+ * full repaints (the shadow is dropped before every frame) and one-row
+ * scrolls. Usage: frame_bench FILE [ROWS COLS] */
+
+#define FRAMES 2000
+
+static double run(int repaint, long *bytes) {
+  struct abuf ab = ABUF_INIT;
+  *bytes = 0;
+  double start = now_ms();
+  for (int i = 0; i < FRAMES; i++) {
+    if (repaint) {
+      E.screen.valid = 0;
+    } else {
+      E.rowoff = i % (E.numrows > 1 ? E.numrows - 1 : 1);
+    }
+    draw_rows();
+    draw_status_bar();
+    draw_message_bar();
+    ab.len = 0;
+    screen_flush(&E.screen, &ab, 0, 0);
+    *bytes += ab.len;
+  }
+  double elapsed = now_ms() - start;
+  ab_free(&ab);
+  return elapsed * 1e3 / FRAMES;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [ROWS COLS]\n", argv[0]);
+    return 1;
+  }
+  E.screen_rows = argc >= 4 ? atoi(argv[2]) : 50;
+  E.screen_cols = argc >= 4 ? atoi(argv[3]) : 200;
+  E.hl_gen = 1;
+  screen_resize(&E.screen, E.screen_rows + 2, E.screen_cols);
+  open_file(argv[1]);
+  set_status_message("frame_bench");
+
+  long bytes;
+  double us = run(1, &bytes);
+  printf("repaint: %8.1f us/frame %8ld bytes/frame\n", us, bytes / FRAMES);
+  us = run(0, &bytes);
+  printf("scroll:  %8.1f us/frame %8ld bytes/frame\n", us, bytes / FRAMES);
+  return 0;
+}
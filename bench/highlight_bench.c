@@ -0,0 +1,88 @@
+#include "../document.h"
+#include "../view.h"
+
+/* Times highlighting a whole file on 1, 2, 4 and 8 threads and checks that
+ * every run leaves exactly the highlighting that lexing the rows in order
+ * with highlight_rows does: the hl bytes, checkpoints and comment state of
+ * every row. Every row gets a view on the first run, so all of it is
+ * compared. Usage: highlight_bench FILE [LOADED], where LOADED 0 leaves the
+ * rows unloaded so they are lexed out of the mapping. */
+
+/* Appends a checkpoint field by field, leaving out the padding bytes. */
+static void append_checkpoint(struct abuf *ab, const struct hl_checkpoint *c) {
+  ab_append(ab, (char *)&c->pos, sizeof(c->pos));
+  ab_append(ab, &c->st.in_string, 1);
+  ab_append(ab, &c->st.in_comment, 1);
+  ab_append(ab, &c->st.prev_sep, 1);
+  ab_append(ab, (char *)&c->st.prev_hl, 1);
+}
+
+static void snapshot(struct abuf *ab) {
+  ab_reset(ab);
+  for (erow *row = row_at(0); row; row = row_next(row)) {
+    struct row_view *v = row->view;
+    ab_append(ab, (char *)&row->hl_open_comment, sizeof(row->hl_open_comment));
+    if (v) {
+      ab_append(ab, (char *)&v->hl_nckpt, sizeof(v->hl_nckpt));
+      for (ssize_t i = 0; i < v->hl_nckpt; i++) {
+        append_checkpoint(ab, &v->hl_ckpt[i]);
+      }
+      ab_append(ab, (char *)v->hl, row->size);
+    }
+  }
+}
+
+/* Forgets all highlighting, so nothing of an earlier run can leak through. */
+static void scrub() {
+  E.hl_gen++;
+  for (erow *row = row_at(0); row; row = row_next(row)) {
+    row->hl_open_comment = 0;
+    if (row->view) {
+      row->view->hl_nckpt = 0;
+      memset(row->view->hl, 0xff, row->size);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [LOADED]\n", argv[0]);
+    return 1;
+  }
+  E.hl_gen = 1;
+  open_file(argv[1]);
+  if (E.syntax == NULL) {
+    fprintf(stderr, "%s: no syntax for this file\n", argv[1]);
+    return 1;
+  }
+  if (argc < 3 || atoi(argv[2])) {
+    for (erow *row = row_at(0); row; row = row_next(row)) {
+      row_load(row);
+    }
+  }
+
+  struct abuf serial = ABUF_INIT, parallel = ABUF_INIT;
+  printf("%d rows, %ld CPUs\n", E.numrows, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%8s %10s %8s %s\n", "threads", "ms", "speedup", "output");
+  scrub();
+  double start = now_ms();
+  highlight_rows(0, E.numrows);
+  double base = now_ms() - start;
+  snapshot(&serial);
+  printf("%8s %10.1f %7.2fx\n", "serial", base, 1.0);
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    scrub();
+    start = now_ms();
+    highlight_all(threads);
+    double ms = now_ms() - start;
+    snapshot(&parallel);
+    int same = serial.len == parallel.len &&
+               !memcmp(serial.b, parallel.b, serial.len);
+    printf("%8d %10.1f %7.2fx %s\n", threads, ms, base / ms,
+           same ? "identical" : "DIFFERENT");
+    if (!same) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,116 @@
+#define _XOPEN_SOURCE 600
+#include "../editor.h"
+#include <poll.h>
+#include <sys/wait.h>
+
+/* Measures end-to-end input latency: kilo runs on a pty, bursts of keys are
+ * written to it at once, and the time until the frame showing the last key
+ * arrives is taken. Each burst types a line and ends with Enter, so its last
+ * frame is the one that puts the cursor at the start of the next row.
+ * Usage: latency_bench [KILO [BURST...]] */
+
+#define ROWS 200
+#define COLS 80
+#define REPEATS 20
+
+static int spawn(const char *kilo, const char *file) {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1) {
+    die("posix_openpt");
+  }
+  struct winsize ws = {ROWS, COLS, 0, 0};
+  ioctl(fd, TIOCSWINSZ, &ws);
+  char *name = ptsname(fd);
+  if (fork() == 0) {
+    setsid();
+    int tty = open(name, O_RDWR);
+    dup2(tty, STDIN_FILENO);
+    dup2(tty, STDOUT_FILENO);
+    close(tty);
+    close(fd);
+    execl(kilo, kilo, file, (char *)NULL);
+    _exit(127);
+  }
+  return fd;
+}
+
+/* Reads output until none has come for quiet_ms, or until marker appears if
+ * one is given. Returns how many frames went by. */
+static int drain(int fd, int quiet_ms, const char *marker) {
+  static char tail[64 + 4096];
+  int keep = 0, frames = 0;
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (poll(&pfd, 1, quiet_ms) > 0) {
+    int n = read(fd, &tail[keep], sizeof(tail) - keep - 1);
+    if (n <= 0) {
+      break;
+    }
+    tail[keep + n] = '\0';
+    for (char *p = tail; (p = strstr(p, "\x1b[?2026h")); p++) {
+      frames += p >= &tail[keep];
+    }
+    if (marker && strstr(tail, marker)) {
+      break;
+    }
+    int len = keep + n;
+    keep = len < 63 ? len : 63;
+    memmove(tail, &tail[len - keep], keep);
+  }
+  return frames;
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+  static char *defaults[] = {"1", "10", "100", "1000"};
+  const char *kilo = argc > 1 ? argv[1] : "./kilo";
+  char **bursts = argc > 2 ? &argv[2] : defaults;
+  int nbursts = argc > 2 ? argc - 2 : 4;
+  if (nbursts * REPEATS >= ROWS - 2) {
+    fprintf(stderr, "too many bursts\n");
+    return 1;
+  }
+  char file[] = "/tmp/latency_benchXXXXXX";
+  close(mkstemp(file));
+  int fd = spawn(kilo, file);
+  drain(fd, 300, NULL);
+
+  printf("%8s %10s %10s %8s\n", "keys", "median ms", "max ms", "frames");
+  int row = 1;
+  for (int b = 0; b < nbursts; b++) {
+    int n = atoi(bursts[b]);
+    char *keys = malloc(n);
+    memset(keys, 'a', n);
+    keys[n - 1] = '\r';
+    double ms[REPEATS];
+    int frames = 0;
+    for (int r = 0; r < REPEATS; r++) {
+      char marker[32];
+      snprintf(marker, sizeof(marker), "\x1b[%d;1H", ++row);
+      double start = now_ms();
+      for (int off = 0; off < n;) {
+        int w = write(fd, &keys[off], n - off);
+        if (w <= 0) {
+          die("write");
+        }
+        off += w;
+      }
+      frames += drain(fd, 5000, marker);
+      ms[r] = now_ms() - start;
+      drain(fd, 20, NULL);
+    }
+    qsort(ms, REPEATS, sizeof(double), compare);
+    printf("%8d %10.2f %10.2f %8.1f\n", n, ms[REPEATS / 2], ms[REPEATS - 1],
+           (double)frames / REPEATS);
+    free(keys);
+  }
+
+  write(fd, "\x11\x11", 2);
+  drain(fd, 300, NULL);
+  wait(NULL);
+  unlink(file);
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "../load.h"
+#include <sys/wait.h>
+
+/* Times indexing a mapped file into rows on 1, 2, 4 and 8 threads. Each run
+ * happens in a fresh process so it pays for its own row memory, and the
+ * best of three is reported. Usage: load_bench FILE [RUNS] */
+
+static double run(const char *map, size_t len, int threads) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    die("pipe");
+  }
+  if (fork() == 0) {
+    double start = now_ms();
+    index_lines(map, len, threads);
+    double ms = now_ms() - start;
+    write(fds[1], &ms, sizeof(ms));
+    _exit(0);
+  }
+  double ms = -1;
+  read(fds[0], &ms, sizeof(ms));
+  wait(NULL);
+  close(fds[0]);
+  close(fds[1]);
+  return ms;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [RUNS]\n", argv[0]);
+    return 1;
+  }
+  int runs = argc > 2 ? atoi(argv[2]) : 3;
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    die("open");
+  }
+  size_t len = st.st_size;
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    die("mmap");
+  }
+  // Fault the file in, so the runs measure scanning rather than the disk
+  size_t lines = count_newlines(map, map + len);
+  printf("%s: %.1f MB, %zu lines, %ld CPUs\n", argv[1], len / 1e6, lines,
+         sysconf(_SC_NPROCESSORS_ONLN));
+
+  printf("%8s %10s %8s %8s\n", "threads", "ms", "GB/s", "speedup");
+  double base = 0;
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    double best = -1;
+    for (int i = 0; i < runs; i++) {
+      double ms = run(map, len, threads);
+      if (best < 0 || ms < best) {
+        best = ms;
+      }
+    }
+    if (threads == 1) {
+      base = best;
+    }
+    printf("%8d %10.1f %8.2f %7.2fx\n", threads, best, len / best / 1e6,
+           base / best);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include "../document.h"
+#include "../view.h"
+
+/* Reports the memory held for a file after opening it, after showing pages
+ * spread over all of it, and after typing a character on each of those
+ * pages. Memory is the anonymous resident memory of the process, which
+ * leaves out the pages of the mapped file. Usage: memory_bench FILE [PAGES]
+ *
+ * To try it on a 1 GB file:
+ *   yes 'static int f(int x) { return x * 2; } // 48 bytes' |
+ *     head -c 1G > /tmp/big.c && bench/memory_bench /tmp/big.c */
+
+static long rss_anon_kb() {
+  FILE *fp = fopen("/proc/self/status", "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "RssAnon: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+  return kb;
+}
+
+static void report(const char *what, long base) {
+  double bytes = (rss_anon_kb() - base) * 1024.0;
+  printf("%-8s %10.1f MB %8.1f bytes/row %6.3f bytes/byte\n", what,
+         bytes / (1 << 20), bytes / (E.numrows ? E.numrows : 1),
+         E.map_len ? bytes / E.map_len : 0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [PAGES]\n", argv[0]);
+    return 1;
+  }
+  int pages = argc > 2 ? atoi(argv[2]) : 1000;
+  E.screen_rows = 50;
+  E.screen_cols = 200;
+  E.hl_gen = 1;
+  screen_resize(&E.screen, E.screen_rows + 2, E.screen_cols);
+  long base = rss_anon_kb();
+
+  open_file(argv[1]);
+  printf("%.1f MB, %d rows, %zu bytes per row struct\n",
+         E.map_len / 1048576.0, E.numrows, sizeof(erow));
+  report("open", base);
+
+  for (int i = 0; i < pages; i++) {
+    E.rowoff = (long long)E.numrows * i / pages;
+    draw_rows();
+  }
+  report("shown", base);
+
+  for (int i = 0; i < pages && E.numrows > 0; i++) {
+    E.cy = E.rowoff = (long long)E.numrows * i / pages;
+    E.cx = 0;
+    insert_text("x", 1);
+    draw_rows();
+  }
+  report("edited", base);
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include "../search.h"
+
+/* Times the literal and regex search paths over a whole file.
+ * Usage: search_bench FILE [QUERY...]; queries starting with / are regexes. */
+
+int main(int argc, char *argv[]) {
+  static char *defaults[] = {"timeout=", "/timeout=[0-9]+",
+                             "/ERROR.*timeout=[0-9]+", "/^[A-Z]+ [0-9]+",
+                             "zzzz", "/zz[a-z]*zz"};
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [QUERY...]\n", argv[0]);
+    return 1;
+  }
+  E.hl_gen = 1;
+  open_file(argv[1]);
+  char **queries = argc > 2 ? &argv[2] : defaults;
+  int nqueries = argc > 2 ? argc - 2 : 6;
+  struct stat st;
+  if (stat(argv[1], &st) == -1) {
+    die("stat");
+  }
+  double mb = st.st_size / 1e6;
+
+  for (int i = 0; i < nqueries; i++) {
+    int regex = queries[i][0] == '/';
+    const char *query = queries[i] + regex;
+    struct search s = {0};
+    double best = 1e30;
+    for (int run = 0; run < 3; run++) {
+      search_reset(&s);
+      double start = now_ms();
+      search_run(&s, query, regex ? SEARCH_REGEX : 0);
+      double elapsed = now_ms() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    printf("%-7s %-26s %8d matches %8.1f ms %8.1f MB/s\n",
+           regex ? "regex" : "literal", query, s.nmatches, best,
+           mb / best * 1e3);
+    search_reset(&s);
+  }
+  return 0;
+}
@@ -0,0 +1,241 @@
+#include "../editor.h"
+#include "../input.h"
+#include "../perf.h"
+
+/* Replays a scripted editing session against the editor run on a headless
+ * terminal: typing, newlines and backspaces mid-file, pastes, page scrolling,
+ * searches typed into the find prompt and saves. Every step is timed from
+ * feeding its keys until the editor has drawn the result and is idle again,
+ * and latency percentiles and throughput are reported per operation. With MB
+ * given, FILE is first overwritten with that many megabytes of generated C.
+ * With KILO_TRACE set, the session's spans are written there as a trace.
+ * Usage: session_bench FILE [MB] */
+
+#define ROWS 50
+#define COLS 200
+#define PASTE_BYTES 16384
+
+enum { OP_OPEN, OP_TYPE, OP_NEWLINE, OP_BACKSPACE, OP_PASTE, OP_PAGE_DOWN,
+       OP_PAGE_UP, OP_SEARCH, OP_SAVE, NOPS };
+
+static const char *op_names[NOPS] = {"open",      "type",    "newline",
+                                     "backspace", "paste",   "page down",
+                                     "page up",   "search",  "save"};
+
+static struct op {
+  double *ms;
+  int n, cap;
+  double bytes; // moved per sample, for MB/s; 0 for plain keys
+} ops[NOPS];
+
+// A step feeds keys and is timed as op unless op is -1. A step that jumps
+// first puts the cursor in the middle of the file.
+static struct step {
+  int op;
+  int jump;
+  char *keys;
+  size_t len;
+} *steps;
+static int nsteps, cap, current;
+static double started;
+
+static void add(int op, int jump, const char *keys, size_t len) {
+  if (nsteps == cap) {
+    cap = cap ? cap * 2 : 256;
+    steps = realloc(steps, sizeof(*steps) * cap);
+  }
+  struct step *s = &steps[nsteps++];
+  s->op = op;
+  s->jump = jump;
+  s->keys = malloc(len);
+  s->len = len;
+  memcpy(s->keys, keys, len);
+}
+
+static void add_str(int op, const char *keys) { add(op, 0, keys, strlen(keys)); }
+
+static void record(int op, double ms) {
+  struct op *o = &ops[op];
+  if (o->n == o->cap) {
+    o->cap = o->cap ? o->cap * 2 : 256;
+    o->ms = realloc(o->ms, sizeof(double) * o->cap);
+  }
+  o->ms[o->n++] = ms;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(struct op *o, int p) {
+  return o->ms[(o->n - 1) * p / 100];
+}
+
+static void report() {
+  printf("%-10s %6s %9s %9s %9s %9s %10s %9s\n", "op", "count", "p50 ms",
+         "p90 ms", "p99 ms", "max ms", "ops/s", "MB/s");
+  for (int i = 0; i < NOPS; i++) {
+    struct op *o = &ops[i];
+    if (o->n == 0) {
+      continue;
+    }
+    double total = 0;
+    for (int j = 0; j < o->n; j++) {
+      total += o->ms[j];
+    }
+    qsort(o->ms, o->n, sizeof(double), cmp_double);
+    printf("%-10s %6d %9.3f %9.3f %9.3f %9.3f %10.1f", op_names[i], o->n,
+           percentile(o, 50), percentile(o, 90), percentile(o, 99),
+           o->ms[o->n - 1], o->n / total * 1e3);
+    if (o->bytes > 0) {
+      printf(" %9.1f", o->bytes * o->n / total / 1e3);
+    }
+    printf("\n");
+  }
+  printf("%lld bytes drawn\n", term_written());
+  if (PERF_ON()) {
+    printf("%d spans written to %s\n", perf_export(perf_trace_path()),
+           perf_trace_path());
+  }
+}
+
+/* Called by the headless terminal whenever the editor waits for a key: the
+ * step fed last is done, so it is timed and the next one fed. */
+static void next_step() {
+  double now = now_ms();
+  if (steps[current].op != -1) {
+    record(steps[current].op, now - started);
+  }
+  if (++current == nsteps) {
+    report();
+    exit(0);
+  }
+  struct step *s = &steps[current];
+  if (s->jump) {
+    E.cy = E.numrows / 2;
+    E.cx = 0;
+  }
+  started = now_ms();
+  term_feed(s->keys, s->len);
+}
+
+static void generate(const char *path, long mb) {
+  static const char *lines[] = {
+      "/* Block %d of generated code, with a comment that",
+      " * spans lines so highlighting has state to carry. */",
+      "static int func_%d(int x, const char *s) {",
+      "\tchar buf[64] = \"string %d with \\\"escapes\\\"\";",
+      "\tif (x > %d && s != NULL) {",
+      "\t\treturn x * %d + 0x%x; // trailing comment",
+      "\t}",
+      "\tfor (int i = 0; i < %d; i++) x += buf[i %% 64];",
+      "\treturn needle_%d;",
+      "}",
+      "",
+  };
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    exit(1);
+  }
+  long long want = (long long)mb << 20, done = 0;
+  for (int i = 0; done < want; i++) {
+    for (size_t j = 0; j < sizeof(lines) / sizeof(lines[0]); j++) {
+      done += fprintf(fp, lines[j], i, i * 7) + 1;
+      fputc('\n', fp);
+    }
+  }
+  fclose(fp);
+}
+
+static void script(double file_bytes) {
+  static const char text[] = "int x = 42; /* typed */ ";
+  char keys[PASTE_BYTES];
+
+  // Open is timed to its first frame
+  add(OP_OPEN, 0, "", 0);
+
+  // Typing, a newline every 40 keys, then deleting some of it
+  for (int i = 0; i < 2000; i++) {
+    if (i % 40 == 39) {
+      add_str(OP_NEWLINE, "\r");
+    } else {
+      add(OP_TYPE, i == 0, &text[i % (sizeof(text) - 1)], 1);
+    }
+  }
+  for (int i = 0; i < 500; i++) {
+    add_str(OP_BACKSPACE, "\x7f");
+  }
+
+  // Pastes of whole lines
+  int len = snprintf(keys, sizeof(keys), "\x1b[200~");
+  for (int i = 0; len < PASTE_BYTES - 64; i++) {
+    len += snprintf(&keys[len], sizeof(keys) - len,
+                    "\tpasted_line(%d, \"text\"); /* note */\r", i);
+  }
+  ops[OP_PASTE].bytes = len - 6;
+  len += snprintf(&keys[len], sizeof(keys) - len, "\x1b[201~");
+  for (int i = 0; i < 20; i++) {
+    add(OP_PASTE, i == 0, keys, len);
+  }
+
+  for (int i = 0; i < 300; i++) {
+    add(OP_PAGE_DOWN, i == 0, "\x1b[6~", 4);
+  }
+  for (int i = 0; i < 300; i++) {
+    add_str(OP_PAGE_UP, "\x1b[5~");
+  }
+
+  // Queries are typed into the prompt, searching on every key; escape then
+  // closes it. Ctrl-R makes the last one a regex.
+  static const char *queries[] = {"\x06needle_4242;", "\x06return",
+                                  "\x06\x12needle_[0-9]+7;", "\x06zzzz"};
+  ops[OP_SEARCH].bytes = file_bytes;
+  for (int i = 0; i < 3; i++) {
+    for (size_t j = 0; j < sizeof(queries) / sizeof(queries[0]); j++) {
+      add_str(OP_SEARCH, queries[j]);
+      add_str(-1, "\x1b");
+    }
+  }
+
+  ops[OP_SAVE].bytes = file_bytes;
+  for (int i = 0; i < 3; i++) {
+    add_str(-1, "x");
+    add_str(OP_SAVE, "\x13");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [MB]\n", argv[0]);
+    return 1;
+  }
+  if (argc >= 3) {
+    generate(argv[1], atol(argv[2]));
+  }
+  struct stat st;
+  if (stat(argv[1], &st) == -1) {
+    perror(argv[1]);
+    return 1;
+  }
+  script(st.st_size);
+
+  term_headless(ROWS, COLS, next_step);
+  init();
+  if (getenv("KILO_TRACE")) {
+    perf_enable(1);
+  }
+  started = now_ms();
+  open_file(argv[1]);
+  printf("%s: %.1f MB, %d rows\n", argv[1], st.st_size / 1e6, E.numrows);
+
+  // The editor's own loop; the script ends it
+  while (1) {
+    refresh_screen();
+    do {
+      process_key_press();
+    } while (input_pending(0));
+  }
+  return 0;
+}
@@ -0,0 +1,152 @@
+#include "../editor.h"
+#include "../document.h"
+#include "../save.h"
+#include <sys/mman.h>
+
+/* Stress test for files past 4 GB. FILE is overwritten with a sparse file
+ * holding lines of text around one row of GB gigabytes of NULs, which takes
+ * next to no disk until saved. The file is opened, edited before, after and
+ * at the end of that row, drawn at both ends and saved, and the saved file
+ * is checked byte for byte against the original with the edits spliced in.
+ * Usage: sparse_bench FILE [GB] */
+
+#define ROWS 50
+#define COLS 200
+#define LINES 5000 // on each side of the big row, more than HL_SYNC_ROWS
+
+static const char head_edit[] = "/* edited at the start */ ";
+static const char tail_edit[] = "/* edited past the big row */ ";
+static const char end_edit[] = " /* appended */\nlast row added by the edit";
+
+static void fail(const char *what) {
+  fprintf(stderr, "sparse_bench: %s\n", what);
+  exit(1);
+}
+
+static size_t write_lines(int fd, off_t at, const char *what) {
+  char line[128];
+  size_t done = 0;
+  for (int i = 0; i < LINES; i++) {
+    int len = snprintf(line, sizeof(line), "%s line %d of %d\n", what, i,
+                       LINES);
+    if (pwrite(fd, line, len, at + done) != len) {
+      perror("pwrite");
+      exit(1);
+    }
+    done += len;
+  }
+  return done;
+}
+
+/* Writes the head lines, leaves a hole of gb gigabytes that ends the big row
+ * with a newline, then writes the tail lines. Returns where the tail starts. */
+static off_t generate(const char *path, long gb) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror(path);
+    exit(1);
+  }
+  off_t hole = write_lines(fd, 0, "head") + ((off_t)gb << 30);
+  if (pwrite(fd, "\n", 1, hole) != 1) {
+    perror("pwrite");
+    exit(1);
+  }
+  write_lines(fd, hole + 1, "tail");
+  close(fd);
+  return hole + 1;
+}
+
+/* Compares len bytes of got from *pos on with want, moving *pos on. */
+static void expect(const char *got, size_t *pos, const char *want, size_t len) {
+  const size_t chunk = 64 << 20;
+  for (size_t i = 0; i < len; i += chunk) {
+    size_t n = len - i < chunk ? len - i : chunk;
+    if (memcmp(&got[*pos + i], &want[i], n) != 0) {
+      fprintf(stderr, "sparse_bench: mismatch near offset %zu\n", *pos + i);
+      exit(1);
+    }
+  }
+  *pos += len;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FILE [GB]\n", argv[0]);
+    return 1;
+  }
+  long gb = argc > 2 ? atol(argv[2]) : 4;
+  size_t tail = generate(argv[1], gb);
+
+  term_headless(ROWS, COLS, NULL);
+  init();
+  double t = now_ms();
+  open_file(argv[1]);
+  double open_ms = now_ms() - t;
+  size_t len = E.map_len;
+  int big = LINES;
+  if (E.numrows != 2 * LINES + 1 || row_at(big)->size != (ssize_t)gb << 30) {
+    fail("rows not split where expected");
+  }
+  printf("%s: %.2f GB, %d rows, big row of %zd bytes\n", argv[1], len / 1e9,
+         E.numrows, row_at(big)->size);
+
+  // Each edit is drawn with the big row off screen
+  t = now_ms();
+  E.cy = E.cx = 0;
+  insert_text(head_edit, strlen(head_edit));
+  refresh_screen();
+  E.cy = E.rowoff = big + 1;
+  E.cx = 0;
+  insert_text(tail_edit, strlen(tail_edit));
+  refresh_screen();
+  E.cy = E.numrows - 1;
+  E.cx = row_at(E.cy)->size;
+  insert_text(end_edit, strlen(end_edit));
+  refresh_screen();
+  double edit_ms = now_ms() - t;
+
+  t = now_ms();
+  save_file();
+  save_wait();
+  double save_ms = now_ms() - t;
+  if (E.version != E.saved_version) {
+    fail(E.statusmsg);
+  }
+
+  // The old mapping still holds the original contents after the rename
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(argv[1]);
+    return 1;
+  }
+  size_t want = len + strlen(head_edit) + strlen(tail_edit) + strlen(end_edit);
+  if ((size_t)st.st_size != want) {
+    fail("saved file has the wrong size");
+  }
+  char *got = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (got == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  t = now_ms();
+  size_t pos = 0;
+  expect(got, &pos, head_edit, strlen(head_edit));
+  expect(got, &pos, E.map, tail);
+  expect(got, &pos, tail_edit, strlen(tail_edit));
+  expect(got, &pos, &E.map[tail], len - 1 - tail);
+  expect(got, &pos, end_edit, strlen(end_edit));
+  expect(got, &pos, &E.map[len - 1], 1);
+  double check_ms = now_ms() - t;
+  munmap(got, st.st_size);
+  close(fd);
+  unlink(argv[1]);
+
+  printf("%-6s %10.1f ms %9.1f MB/s\n", "open", open_ms, len / open_ms / 1e3);
+  printf("%-6s %10.1f ms\n", "edit", edit_ms);
+  printf("%-6s %10.1f ms %9.1f MB/s\n", "save", save_ms, want / save_ms / 1e3);
+  printf("%-6s %10.1f ms %9.1f MB/s\n", "check", check_ms,
+         want / check_ms / 1e3);
+  printf("ok\n");
+  return 0;
+}
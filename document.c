@@ -0,0 +1,247 @@
+#include "document.h"
+#include "save.h"
+#include "view.h"
+
+#define ROWS_PER_SLAB 1024
+
+static erow *free_rows = NULL;
+
+static unsigned int next_random() {
+  static unsigned int x = 2463534242u;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static int count(erow *t) { return t ? t->count : 0; }
+
+static int loaded(erow *t) { return t ? t->loaded : 0; }
+
+static void pull(erow *t) {
+  t->count = count(t->left) + count(t->right) + 1;
+  t->loaded = loaded(t->left) + loaded(t->right) + (t->chars != NULL);
+  if (t->left) {
+    t->left->parent = t;
+  }
+  if (t->right) {
+    t->right->parent = t;
+  }
+}
+
+/* Joins two trees, picking the root with probability proportional to size so
+ * the result stays a random BST. */
+static erow *merge(erow *a, erow *b) {
+  if (a == NULL) {
+    return b;
+  }
+  if (b == NULL) {
+    return a;
+  }
+  if (next_random() % (unsigned int)(a->count + b->count) <
+      (unsigned int)a->count) {
+    a->right = merge(a->right, b);
+    pull(a);
+    return a;
+  }
+  b->left = merge(a, b->left);
+  pull(b);
+  return b;
+}
+
+/* Splits t into its first k rows and the rest. */
+static void split(erow *t, int k, erow **l, erow **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  if (count(t->left) < k) {
+    split(t->right, k - count(t->left) - 1, &t->right, r);
+    pull(t);
+    *l = t;
+  } else {
+    split(t->left, k, l, &t->left);
+    pull(t);
+    *r = t;
+  }
+}
+
+static erow *build(erow **rows, int n) {
+  if (n == 0) {
+    return NULL;
+  }
+  int mid = n / 2;
+  erow *t = rows[mid];
+  t->left = build(rows, mid);
+  t->right = build(rows + mid + 1, n - mid - 1);
+  pull(t);
+  return t;
+}
+
+erow *rows_build(erow *rows, int n) {
+  if (n == 0) {
+    return NULL;
+  }
+  int mid = n / 2;
+  erow *t = &rows[mid];
+  t->left = rows_build(rows, mid);
+  t->right = rows_build(rows + mid + 1, n - mid - 1);
+  pull(t);
+  return t;
+}
+
+static void set_root(erow *t) {
+  if (t) {
+    t->parent = NULL;
+  }
+  E.doc = t;
+  E.numrows = count(t);
+}
+
+erow *row_new() {
+  if (free_rows == NULL) {
+    erow *slab = malloc(sizeof(erow) * ROWS_PER_SLAB);
+    if (slab == NULL) {
+      die("malloc");
+    }
+    for (int i = 0; i < ROWS_PER_SLAB; i++) {
+      slab[i].right = free_rows;
+      free_rows = &slab[i];
+    }
+  }
+  erow *row = free_rows;
+  free_rows = row->right;
+  memset(row, 0, sizeof(erow));
+  row->count = 1;
+  return row;
+}
+
+static void row_free(erow *t) {
+  if (t == NULL) {
+    return;
+  }
+  row_free(t->left);
+  row_free(t->right);
+  if (E.saving && t->frozen == E.save_epoch) {
+    save_retire(t->chars);
+  } else {
+    free(t->chars);
+  }
+  view_free(t);
+  t->right = free_rows;
+  free_rows = t;
+}
+
+erow *row_at(int at) {
+  erow *t = E.doc;
+  while (t) {
+    int l = count(t->left);
+    if (at < l) {
+      t = t->left;
+    } else if (at == l) {
+      return t;
+    } else {
+      at -= l + 1;
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+int row_index(erow *row) {
+  int at = count(row->left);
+  for (; row->parent; row = row->parent) {
+    if (row == row->parent->right) {
+      at += count(row->parent->left) + 1;
+    }
+  }
+  return at;
+}
+
+erow *row_next(erow *row) {
+  if (row->right) {
+    row = row->right;
+    while (row->left) {
+      row = row->left;
+    }
+    return row;
+  }
+  while (row->parent && row == row->parent->right) {
+    row = row->parent;
+  }
+  return row->parent;
+}
+
+erow *row_prev(erow *row) {
+  if (row->left) {
+    row = row->left;
+    while (row->right) {
+      row = row->right;
+    }
+    return row;
+  }
+  while (row->parent && row == row->parent->left) {
+    row = row->parent;
+  }
+  return row->parent;
+}
+
+/* Must be called when a row in the tree gets its chars. */
+void row_loaded(erow *row) {
+  for (; row; row = row->parent) {
+    row->loaded = loaded(row->left) + loaded(row->right) + (row->chars != NULL);
+  }
+}
+
+static int first_loaded(erow *t, int at) {
+  if (loaded(t) == 0) {
+    return -1;
+  }
+  int l = count(t->left);
+  if (at < l) {
+    int i = first_loaded(t->left, at);
+    if (i != -1) {
+      return i;
+    }
+  }
+  if (at <= l && t->chars) {
+    return l;
+  }
+  int i = first_loaded(t->right, at > l ? at - l - 1 : 0);
+  return i == -1 ? -1 : l + 1 + i;
+}
+
+/* The index of the first loaded row at or after at, or E.numrows. */
+int row_next_loaded(int at) {
+  int i = first_loaded(E.doc, at);
+  return i == -1 ? E.numrows : i;
+}
+
+void rows_insert(int at, erow **rows, int n) {
+  rows_insert_tree(at, build(rows, n));
+}
+
+void rows_insert_tree(int at, erow *mid) {
+  erow *l, *r;
+  split(E.doc, at, &l, &r);
+  if (mid) {
+    mid->parent = NULL;
+  }
+  set_root(merge(merge(l, mid), r));
+}
+
+void rows_delete(int at, int n) {
+  erow *l, *mid, *r;
+  split(E.doc, at, &l, &r);
+  split(r, n, &mid, &r);
+  row_free(mid);
+  set_root(merge(l, r));
+  // Saving writes a run of unloaded rows as one slice of the mapping, which
+  // only works while the rows in it still follow each other there
+  erow *prev = at > 0 ? row_at(at - 1) : NULL;
+  erow *next = prev ? row_next(prev) : NULL;
+  if (next && !prev->chars && !next->chars &&
+      prev->src + prev->size + 1 != next->src) {
+    E.map_gaps = 1;
+  }
+}
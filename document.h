@@ -0,0 +1,22 @@
+#ifndef DOCUMENT
+#define DOCUMENT
+
+#include "editor.h"
+
+/* Rows are kept in a randomized balanced tree ordered by position, so
+ * lookups, inserts and deletes are all O(log n) and no row stores its own
+ * index. */
+
+erow *row_new();
+erow *row_at(int at);
+int row_index(erow *row);
+erow *row_next(erow *row);
+erow *row_prev(erow *row);
+void row_loaded(erow *row);
+int row_next_loaded(int at);
+void rows_insert(int at, erow **rows, int n);
+erow *rows_build(erow *rows, int n);
+void rows_insert_tree(int at, erow *tree);
+void rows_delete(int at, int n);
+
+#endif
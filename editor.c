@@ -1,7 +1,24 @@
 #include "editor.h"
+#include "document.h"
+#include "input.h"
+#include "keywords.h"
+#include "load.h"
+#include "perf.h"
+#include "save.h"
+#include "search.h"
+#include "undo.h"
+#include "utf8.h"
+#include "view.h"
+#include <pthread.h>
 
 struct editor_config E;
 
+// The search running while the find prompt is open
+static struct search search;
+static int search_current = -1;
+static int search_flags;
+static char search_prompt[80];
+
 /* Syntax highlighting */
 
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -10,7 +27,8 @@ char *C_HL_keywords[] = {
   "struct", "union", "typedef", "static", "enum", "class", "case",
   
   "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-  "void|", "size_t|", "const|", "extern|", "bool|", "volatile|", "register|"
+  "void|", "size_t|", "const|", "extern|", "bool|", "volatile|", "register|",
+  NULL
 };
 
 char *PY_HL_extensions[] = {".py", NULL};
@@ -21,7 +39,8 @@ char *PY_HL_keywords[] = {
   "while", "with", "yield",
   
   "False|", "None|", "True|", "self|", "int|", "float|", "str|", "list|", "dict|",
-  "set|", "bool|", "bytes|", "tuple|", "range|", "object|", "Exception|"
+  "set|", "bool|", "bytes|", "tuple|", "range|", "object|", "Exception|",
+  NULL
 };
 
 struct editorSyntax HLDB[] = {
@@ -30,21 +49,37 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
   {
     "python",
     PY_HL_extensions,
     PY_HL_keywords,
     "#", "\"\"\"", "\"\"\"",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   }
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/* Picks up a new terminal size, returning -1 if it cannot be read. */
+static int resize_window() {
+  int rows, cols;
+  if (get_window_size(&rows, &cols) == -1) {
+    return -1;
+  }
+  E.screen_rows = rows - 2;
+  E.screen_cols = cols;
+  screen_resize(&E.screen, rows, cols);
+  return 0;
+}
+
 void init() {
-  E.row = NULL;
+  E.doc = NULL;
+  E.map = NULL;
+  E.map_len = 0;
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
@@ -52,39 +87,197 @@ void init() {
   E.cy = 0;
   E.rx = 0;
   enable_raw_mode();
-  if (get_window_size(&E.screen_rows, &E.screen_cols) == -1) {
+  input_init();
+  if (resize_window() == -1) {
     die("get_windows_size");
   }
-  E.screen_rows -= 2;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
-  E.statusmsg_time = 0;
-  E.dirty = 0;
+  E.version = 0;
+  E.saved_version = 0;
+  E.saving = 0;
+  E.save_epoch = 0;
+  E.map_crlf = 0;
+  E.map_gaps = 0;
   E.syntax = NULL;
+  E.hl_gen = 1;
+  E.hl_stale = INT_MAX;
+}
+
+/* Row storage
+ *
+ * chars is a gap buffer: bytes [0, gap) sit at the front of the allocation
+ * and bytes [gap, size) at the back, so repeated edits at one spot only move
+ * the bytes between successive edit points. */
+
+/* Gives a row frozen by a running save its own copy of chars, so the writer
+ * keeps seeing the bytes it was handed. */
+static void row_thaw(erow *row) {
+  if (!E.saving || row->frozen != E.save_epoch) {
+    return;
+  }
+  char *chars = malloc(row->cap);
+  if (chars == NULL) {
+    die("malloc");
+  }
+  memcpy(chars, row->chars, row->cap);
+  save_retire(row->chars);
+  row->chars = chars;
+  row->frozen = 0;
+}
+
+static void row_move_gap(erow *row, ssize_t at) {
+  if (at == row->gap) {
+    return;
+  }
+  row_thaw(row);
+  if (at < row->gap) {
+    memmove(&row->chars[at + GAP_LEN(row)], &row->chars[at], row->gap - at);
+  } else if (at > row->gap) {
+    memmove(&row->chars[row->gap], &row->chars[row->gap + GAP_LEN(row)],
+            at - row->gap);
+  }
+  row->gap = at;
+}
+
+static void row_reserve(erow *row, ssize_t len) {
+  row_thaw(row);
+  if (row->cap - row->size > len) {
+    return;
+  }
+  ssize_t cap = row->cap * 2;
+  if (cap < row->size + len + 1) {
+    cap = row->size + len + 1;
+  }
+  char *chars = realloc(row->chars, cap);
+  if (chars == NULL) {
+    die("realloc");
+  }
+  ssize_t tail = row->size - row->gap;
+  memmove(&chars[cap - tail], &chars[row->cap - tail], tail);
+  row->chars = chars;
+  row->cap = cap;
+}
+
+/* Returns chars as one NUL-terminated string by moving the gap to the end.
+ * The terminator may land on bytes a running save is still writing, so a
+ * frozen row is thawed first. */
+char *row_chars(erow *row) {
+  row_load(row);
+  row_thaw(row);
+  row_move_gap(row, row->size);
+  row->chars[row->size] = '\0';
+  return row->chars;
+}
+
+void row_copy(erow *row, ssize_t at, ssize_t len, char *dst) {
+  if (at < row->gap) {
+    ssize_t n = row->gap - at < len ? row->gap - at : len;
+    memcpy(dst, &row->chars[at], n);
+    dst += n;
+    at += n;
+    len -= n;
+  }
+  memcpy(dst, &row->chars[at + GAP_LEN(row)], len);
 }
 
 void update_row(erow *row) {
-  free(row->render);
-  row->render = malloc(row->size + 1);
-  
-  int j = 0;
-  for (int i = 0; i < row->size; i++) {
-    row->render[j++] = row->chars[i];
+  row_move_gap(row, row->size);
+  row->hl_gen = 0;
+  if (row->view) {
+    row->view->plain = utf8_one_column(row->chars, row->size);
+    row->view->rx_nckpt = 0;
   }
-  row->render[j] = '\0';
-  row->rsize = j;
-  
-  update_syntax(row);
 }
 
-void update_syntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  
-  if (E.syntax == NULL) return;
-  
-  char **keywords = E.syntax->keywords;
+/* Closes the gap after an edit that put inserted bytes in place of removed
+ * ones at at, and splices the highlighting of a shown row to match before
+ * re-highlighting it from the edit onwards. */
+void update_row_span(erow *row, ssize_t at, ssize_t removed,
+                     ssize_t inserted) {
+  row_move_gap(row, row->size);
+  struct row_view *v = row->view;
+  if (v == NULL) {
+    update_syntax_span(row, at, removed, inserted);
+    return;
+  }
+  view_reserve(v, row->size);
+  memmove(&v->hl[at + inserted], &v->hl[at + removed],
+          row->size - at - inserted);
+  if (!utf8_one_column(&row->chars[at], inserted)) {
+    v->plain = 0;
+  }
+  // Column checkpoints before the edit still hold, except that the bytes
+  // just before it may have started a character that now reads differently
+  ssize_t keep = (at > 3 ? at - 3 : 0) / RX_STRIDE + 1;
+  if (v->rx_nckpt > keep) {
+    v->rx_nckpt = keep;
+  }
   
+  if (E.syntax == NULL) {
+    memset(&v->hl[at], HL_NORMAL, inserted);
+    return;
+  }
+  update_syntax_span(row, at, removed, inserted);
+}
+
+/* Syntax highlighting
+ *
+ * Long rows keep a checkpoint of the lexer state roughly every
+ * HL_CHECKPOINT_STRIDE bytes. An edit re-lexes from the last checkpoint
+ * before it and stops as soon as it reaches an old checkpoint in the same
+ * state, since everything after that highlights the same as before. */
+
+#define HL_CHECKPOINT_STRIDE 256
+
+static int same_state(struct hl_state a, struct hl_state b) {
+  return a.in_string == b.in_string && a.in_comment == b.in_comment &&
+         a.prev_sep == b.prev_sep && a.prev_hl == b.prev_hl;
+}
+
+static void push_checkpoint(struct row_view *v, ssize_t pos,
+                            struct hl_state st) {
+  if (v->hl_nckpt == v->hl_ckpt_cap) {
+    v->hl_ckpt_cap = v->hl_ckpt_cap ? v->hl_ckpt_cap * 2 : 4;
+    v->hl_ckpt =
+        realloc(v->hl_ckpt, sizeof(struct hl_checkpoint) * v->hl_ckpt_cap);
+    if (v->hl_ckpt == NULL) {
+      die("realloc");
+    }
+  }
+  v->hl_ckpt[v->hl_nckpt].pos = pos;
+  v->hl_ckpt[v->hl_nckpt].st = st;
+  v->hl_nckpt++;
+}
+
+/* How far ahead of its position the lexer may read. */
+static int syntax_lookahead() {
+  int n = E.syntax->matcher->maxlen + 1;
+  if (n < 2) n = 2;
+  char *delims[] = {E.syntax->singleline_comment_start,
+                    E.syntax->multiline_comment_start,
+                    E.syntax->multiline_comment_end};
+  for (int j = 0; j < 3; j++) {
+    int dlen = delims[j] ? (int)strlen(delims[j]) : 0;
+    if (dlen > n) n = dlen;
+  }
+  return n;
+}
+
+static int match_at(const char *s, ssize_t len, ssize_t i, const char *pat,
+                    int plen) {
+  return i + plen <= len && !memcmp(&s[i], pat, plen);
+}
+
+/* Lexes text from position i in state st and returns whether the line ends
+ * inside a multi-line comment. Checkpoints are kept when lexing into the
+ * highlighting of a shown row. Once past settle, it stops at the first of the
+ * old checkpoints in tail that it reaches in the same state and returns -1,
+ * as nothing after that point can change. */
+static int syntax_lex(erow *row, const char *text, ssize_t len,
+                      unsigned char *hl, ssize_t i, struct hl_state st,
+                      struct hl_checkpoint *tail, ssize_t ntail,
+                      ssize_t settle) {
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
   char *mce = E.syntax->multiline_comment_end;
@@ -93,62 +286,75 @@ void update_syntax(erow *row) {
   int mcs_len = mcs ? strlen(mcs) : 0;
   int mce_len = mce ? strlen(mce) : 0;
   
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->hl_open_comment) ? 1 : 0;
+  struct row_view *v = row->view && hl == row->view->hl ? row->view : NULL;
+  ssize_t last = v && v->hl_nckpt ? v->hl_ckpt[v->hl_nckpt - 1].pos : 0;
+  ssize_t t = 0;
   
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+  while (i < len) {
+    char c = text[i];
+    st.prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+    
+    if (i >= settle) {
+      while (t < ntail && tail[t].pos < i) t++;
+      if (t < ntail && tail[t].pos == i && same_state(tail[t].st, st)) {
+        for (; t < ntail; t++) {
+          push_checkpoint(v, tail[t].pos, tail[t].st);
+        }
+        return -1;
+      }
+    }
+    if (v && i - last >= HL_CHECKPOINT_STRIDE) {
+      push_checkpoint(v, i, st);
+      last = i;
+    }
     
     // Handle single line comments
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+    if (scs_len && !st.in_string && !st.in_comment) {
+      if (match_at(text, len, i, scs, scs_len)) {
+        memset(&hl[i], HL_COMMENT, len - i);
         break;
       }
     }
     
     // Handle multi-line comments
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+    if (mcs_len && mce_len && !st.in_string) {
+      if (st.in_comment) {
+        hl[i] = HL_MLCOMMENT;
+        if (match_at(text, len, i, mce, mce_len)) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
           i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
+          st.in_comment = 0;
+          st.prev_sep = 1;
           continue;
         } else {
           i++;
           continue;
         }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+      } else if (match_at(text, len, i, mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
         i += mcs_len;
-        in_comment = 1;
+        st.in_comment = 1;
         continue;
       }
     }
     
     // Handle strings
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
+      if (st.in_string) {
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < len) {
+          hl[i + 1] = HL_STRING;
           i += 2;
           continue;
         }
-        if (c == in_string) in_string = 0;
+        if (c == st.in_string) st.in_string = 0;
         i++;
-        prev_sep = 1;
+        st.prev_sep = 1;
         continue;
       } else {
         if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
+          st.in_string = c;
+          hl[i] = HL_STRING;
           i++;
           continue;
         }
@@ -157,67 +363,373 @@ void update_syntax(erow *row) {
     
     // Handle numbers
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+      if ((isdigit(c) && (st.prev_sep || st.prev_hl == HL_NUMBER)) ||
+          (c == '.' && st.prev_hl == HL_NUMBER)) {
+        hl[i] = HL_NUMBER;
         i++;
-        prev_sep = 0;
+        st.prev_sep = 0;
         continue;
       }
     }
     
     // Handle keywords
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
+    if (st.prev_sep) {
+      int klen;
+      int kw = match_keyword(E.syntax->matcher, &text[i], len - i, &klen);
+      if (kw != HL_NORMAL) {
+        memset(&hl[i], kw, klen);
+        i += klen;
+        st.prev_sep = 0;
         continue;
       }
     }
     
-    prev_sep = is_separator(c);
+    hl[i] = HL_NORMAL;
+    st.prev_sep = is_separator(c);
     i++;
   }
   
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    update_syntax(&E.row[row->idx + 1]);
+  return st.in_comment;
 }
 
-void insert_row(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) {
+static struct hl_state row_start_state(erow *row) {
+  erow *prev = row_prev(row);
+  struct hl_state st = {0, prev && prev->hl_open_comment, 1, HL_NORMAL};
+  return st;
+}
+
+/* Records whether row ends inside a multi-line comment and returns whether
+ * that changed, in which case the next row has to be lexed again. */
+static int set_open_comment(erow *row, int open) {
+  int changed = (row->hl_open_comment != open);
+  row->hl_open_comment = open;
+  return changed;
+}
+
+/* Highlights a single row as following one that ends inside a multi-line
+ * comment if open is set, and returns whether this one does. Rows that are
+ * not shown are lexed into scratch only for their comment state, which is
+ * all the rows below them need. */
+static int lex_row_after(erow *row, int open, unsigned char **scratch,
+                         ssize_t *scratch_cap) {
+  struct row_view *v = row->view;
+  row->hl_gen = E.hl_gen;
+  if (v) {
+    v->hl_nckpt = 0;
+    view_reserve(v, row->size);
+  }
+  if (E.syntax == NULL) {
+    if (v) {
+      memset(v->hl, HL_NORMAL, row->size);
+    }
+    return 0;
+  }
+  struct hl_state st = {0, open, 1, HL_NORMAL};
+  if (v) {
+    return syntax_lex(row, ROW_TEXT(row), row->size, v->hl, 0, st, NULL, 0, 0);
+  }
+  if (row->size > *scratch_cap) {
+    *scratch_cap = row->size * 2;
+    *scratch = realloc(*scratch, *scratch_cap);
+    if (*scratch == NULL) {
+      die("realloc");
+    }
+  }
+  return syntax_lex(row, ROW_TEXT(row), row->size, *scratch, 0, st, NULL, 0,
+                    0);
+}
+
+static int lex_row(erow *row) {
+  static unsigned char *scratch = NULL;
+  static ssize_t scratch_cap = 0;
+  erow *prev = row_prev(row);
+  return set_open_comment(row, lex_row_after(row, prev && prev->hl_open_comment,
+                                             &scratch, &scratch_cap));
+}
+
+/* Row y may now start in a different comment state. Rows are only re-lexed
+ * from the topmost such row once something below it is shown. */
+static void mark_stale(int y) {
+  if (y < E.hl_stale) {
+    E.hl_stale = y;
+  }
+}
+
+/* Keeps the stale mark on the same row when n rows are inserted at at, or
+ * removed from there if n is negative. */
+static void shift_stale(int at, int n) {
+  if (E.hl_stale == INT_MAX || E.hl_stale < at) {
     return;
   }
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], (E.numrows - at) * sizeof(erow));
+  E.hl_stale = n < 0 && E.hl_stale < at - n ? at : E.hl_stale + n;
+}
+
+/* The comment state at the end of row changed. Rows below it are re-lexed one
+ * at a time until their own state stops changing; the first one off screen is
+ * only marked stale and waits until it or a row below it is shown. */
+static void relex_below(erow *row) {
+  int y = row_index(row) + 1;
+  for (row = row_next(row); row; row = row_next(row), y++) {
+    if (y < E.rowoff || y >= E.rowoff + E.screen_rows) {
+      row->hl_gen = 0;
+      mark_stale(y);
+      return;
+    }
+    if (!lex_row(row)) {
+      return;
+    }
+  }
+}
+
+void update_syntax(erow *row) {
+  if (lex_row(row)) {
+    relex_below(row);
+  }
+}
+
+void update_syntax_span(erow *row, ssize_t at, ssize_t removed,
+                        ssize_t inserted) {
+  static struct hl_checkpoint *tail = NULL;
+  static ssize_t tail_cap = 0;
   
-  E.row[at].idx = at;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  struct row_view *v = row->view;
+  if (row->hl_gen != E.hl_gen || v == NULL) {
+    // Lexed in full once it or a row below it is shown
+    row->hl_gen = 0;
+    mark_stale(row_index(row));
+    return;
+  }
   
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  update_row(&E.row[at]);
+  // Resume from the last checkpoint whose lexing could not see the edit
+  int lookahead = syntax_lookahead();
+  ssize_t r = v->hl_nckpt;
+  while (r > 0 && v->hl_ckpt[r - 1].pos + lookahead > at) {
+    r--;
+  }
   
-  E.numrows++;
-  E.dirty = 1;
+  // Checkpoints past the edit may still match once shifted
+  ssize_t first = r;
+  while (first < v->hl_nckpt && v->hl_ckpt[first].pos < at + removed) {
+    first++;
+  }
+  ssize_t ntail = v->hl_nckpt - first;
+  if (ntail > tail_cap) {
+    tail_cap = ntail * 2;
+    tail = realloc(tail, sizeof(struct hl_checkpoint) * tail_cap);
+    if (tail == NULL) {
+      die("realloc");
+    }
+  }
+  for (ssize_t j = 0; j < ntail; j++) {
+    tail[j] = v->hl_ckpt[first + j];
+    tail[j].pos += inserted - removed;
+  }
+  v->hl_nckpt = r;
+  
+  struct hl_state st = r ? v->hl_ckpt[r - 1].st : row_start_state(row);
+  ssize_t from = r ? v->hl_ckpt[r - 1].pos : 0;
+  int open = syntax_lex(row, row->chars, row->size, v->hl, from, st, tail,
+                        ntail, at + inserted);
+  if (open != -1 && set_open_comment(row, open)) {
+    relex_below(row);
+  }
+}
+
+/* Makes sure rows [at, at + n) are highlighted, giving them views. Lexing
+ * starts at the topmost stale row at most HL_SYNC_ROWS above them, or further
+ * up at the row marked stale by an edit, and carries comment state down until
+ * it stops changing; rows never lexed further up are taken as-is. */
+void highlight_rows(int at, int n) {
+  erow *row = row_at(at);
+  if (row == NULL) {
+    return;
+  }
+  double t = PERF_BEGIN();
+  erow *start = row;
+  erow *prev = row;
+  int back = 0;
+  for (int j = 1; j <= HL_SYNC_ROWS; j++) {
+    prev = row_prev(prev);
+    if (prev == NULL) {
+      break;
+    }
+    if (prev->hl_gen != E.hl_gen) {
+      start = prev;
+      back = j;
+    }
+  }
+  if (E.hl_stale < at - back) {
+    start = row_at(E.hl_stale);
+    back = at - E.hl_stale;
+  }
+  int end = at + n;
+  n += back;
+  int changed = 0;
+  for (row = start; row && n > 0; row = row_next(row), n--, back--) {
+    if (back <= 0) {
+      view_get(row);
+    }
+    if (changed || row->hl_gen != E.hl_gen) {
+      changed = lex_row(row);
+    }
+  }
+  if (changed && row) {
+    row->hl_gen = 0;
+  }
+  // Everything above end follows from the right state now; marks below it
+  // are only known to be no higher than end
+  if (E.hl_stale < end) {
+    E.hl_stale = row ? end : INT_MAX;
+  }
+  PERF_END(PERF_HIGHLIGHT, t);
+}
+
+struct hl_chunk {
+  erow *first;
+  int n;
+  int open; // comment state at the end, lexed as if none was open before
+  unsigned char *scratch;
+  ssize_t scratch_cap;
+};
+
+static void *highlight_chunk(void *arg) {
+  struct hl_chunk *c = arg;
+  int open = 0;
+  erow *row = c->first;
+  for (int i = 0; i < c->n; i++, row = row_next(row)) {
+    open = row->hl_open_comment =
+        lex_row_after(row, open, &c->scratch, &c->scratch_cap);
+  }
+  c->open = open;
+  return NULL;
+}
+
+/* Highlights every row, with the same result as lexing them in order. The
+ * rows are cut into chunks that threads lex at once, each guessing that no
+ * comment is open where it starts. Chunks are then joined in order, and one
+ * whose guess was wrong is lexed again from its start until a row ends in
+ * the state it had under the guess, since the rows after it were lexed from
+ * the right state already. threads 0 means one per CPU. */
+void highlight_all(int threads) {
+  double t = PERF_BEGIN();
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > HL_MAX_THREADS) {
+    threads = HL_MAX_THREADS;
+  }
+  if (threads > E.numrows / HL_CHUNK_ROWS) {
+    threads = E.numrows / HL_CHUNK_ROWS > 0 ? E.numrows / HL_CHUNK_ROWS : 1;
+  }
+  struct hl_chunk chunks[HL_MAX_THREADS];
+  pthread_t tids[HL_MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    int at = (long long)E.numrows * i / threads;
+    chunks[i].first = row_at(at);
+    chunks[i].n = (long long)E.numrows * (i + 1) / threads - at;
+    chunks[i].scratch = NULL;
+    chunks[i].scratch_cap = 0;
+  }
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&tids[i], NULL, highlight_chunk, &chunks[i]) != 0) {
+      highlight_chunk(&chunks[i]);
+      tids[i] = pthread_self();
+    }
+  }
+  highlight_chunk(&chunks[0]);
+
+  int open = chunks[0].open;
+  for (int i = 1; i < threads; i++) {
+    struct hl_chunk *c = &chunks[i];
+    if (!pthread_equal(tids[i], pthread_self())) {
+      pthread_join(tids[i], NULL);
+    }
+    if (!open) {
+      open = c->open; // the guess was right
+      continue;
+    }
+    erow *row = c->first;
+    for (int j = 0; j < c->n; j++, row = row_next(row)) {
+      int guessed = row->hl_open_comment;
+      open = row->hl_open_comment =
+          lex_row_after(row, open, &c->scratch, &c->scratch_cap);
+      if (open == guessed) {
+        open = c->open;
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    free(chunks[i].scratch);
+  }
+  PERF_END(PERF_HIGHLIGHT, t);
+}
+
+static erow *new_row(const char *s, size_t len) {
+  erow *row = row_new();
+  row->size = len;
+  row->cap = len + 1;
+  row->gap = len;
+  row->chars = malloc(row->cap);
+  if (row->chars == NULL) {
+    die("malloc");
+  }
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  update_row(row);
+  return row;
+}
+
+void insert_row(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) {
+    return;
+  }
+  undo_insert_rows(at, s, len, 1);
+  erow *row = new_row(s, len);
+  rows_insert(at, &row, 1);
+  // The next row was highlighted as if it followed the previous one
+  erow *next = row_next(row);
+  if (next) {
+    next->hl_gen = 0;
+  }
+  shift_stale(at, 1);
+  mark_stale(at);
+  
+  E.version++;
+}
+
+/* Inserts the lines of text, separated by newlines, as rows from at on with
+ * a single tree insert. */
+void insert_rows(int at, const char *text, size_t len) {
+  if (at < 0 || at > E.numrows) {
+    return;
+  }
+  int n = 1;
+  for (const char *p = text; (p = memchr(p, '\n', text + len - p)); p++) {
+    n++;
+  }
+  undo_insert_rows(at, text, len, n);
+  erow **rows = malloc(sizeof(erow *) * n);
+  if (rows == NULL) {
+    die("malloc");
+  }
+  const char *p = text, *end = text + len;
+  for (int i = 0; i < n; i++) {
+    const char *nl = memchr(p, '\n', end - p);
+    rows[i] = new_row(p, (nl ? nl : end) - p);
+    if (nl) {
+      p = nl + 1;
+    }
+  }
+  rows_insert(at, rows, n);
+  erow *next = row_next(rows[n - 1]);
+  if (next) {
+    next->hl_gen = 0;
+  }
+  shift_stale(at, n);
+  mark_stale(at);
+  free(rows);
+  E.version++;
 }
 
 void select_syntax_highlight() {
@@ -233,13 +745,15 @@ void select_syntax_highlight() {
       int is_ext = (s->filematch[i][0] == '.');
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
           (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        if (s->matcher == NULL) {
+          s->matcher = compile_keywords(s->keywords);
+        }
         E.syntax = s;
-        
-        // Rehighlight all rows
-        for (int filerow = 0; filerow < E.numrows; filerow++) {
-          update_syntax(&E.row[filerow]);
+        E.hl_gen++; // Rows are re-highlighted as they are shown
+        E.hl_stale = INT_MAX;
+        if (E.numrows <= HL_FULL_ROWS) {
+          highlight_all(0);
         }
-        
         return;
       }
       i++;
@@ -247,139 +761,354 @@ void select_syntax_highlight() {
   }
 }
 
+void row_load(erow *row) {
+  if (row->chars) {
+    return;
+  }
+  row->cap = row->size + 1;
+  row->gap = row->size;
+  row->chars = malloc(row->cap);
+  if (row->chars == NULL) {
+    die("malloc");
+  }
+  memcpy(row->chars, row->src, row->size);
+  row->chars[row->size] = '\0';
+  row_loaded(row);
+}
+
 void open_file(char *filename) {
+  double t = PERF_BEGIN();
   free(E.filename);
   E.filename = strdup(filename);
-  FILE *fp = fopen(filename, "a"); // Ensure the file exists
-  if (!fp) {
-    die("fopen");
-  }
-  fclose(fp);
-  fp = fopen(filename, "r");
-  if (!fp) {
-    die("fopen");
-  }
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
-    }
-    insert_row(E.numrows, line, linelen);
-  }
-  free(line);
-  fclose(fp);
+  int fd = open(filename, O_RDONLY | O_CREAT, 0644); // Ensure the file exists
+  if (fd == -1) {
+    die("open");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    die("fstat");
+  }
+  if (S_ISREG(st.st_mode)) {
+    // Rows are read out of the mapping as they are needed
+    if (st.st_size > 0) {
+      E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (E.map == MAP_FAILED) {
+        die("mmap");
+      }
+      E.map_len = st.st_size;
+      index_lines(E.map, E.map_len, 0);
+    }
+    close(fd);
+  } else {
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+      die("fdopen");
+    }
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+      while (linelen > 0 &&
+             (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+        linelen--;
+      }
+      insert_row(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+  }
   
   select_syntax_highlight();
+  undo_clear(); // loading is not an edit
+  E.saved_version = E.version;
+  PERF_END(PERF_LOAD, t);
 }
 
 void insert_enter() {
   if (E.cx == 0) {
     insert_row(E.cy, "", 0);
   } else {
-    erow *row = &E.row[E.cy];
-    insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy]; // previous refrence is invalid as insert_row callls
-                        // realloc
+    erow *row = row_at(E.cy);
+    ssize_t len = row->size - E.cx;
+    char *tail = &row_chars(row)[E.cx];
+    undo_delete_text(row, E.cx, len);
+    // The cut bytes stay in the gap until the next edit of this row
+    row_thaw(row);
     row->size = E.cx;
-    row->chars[E.cx] = '\0';
+    row->gap = E.cx;
+    update_row_span(row, E.cx, len, 0);
+    insert_row(E.cy + 1, tail, len);
   }
   E.cx = 0;
   E.cy++;
 }
 
-void row_insert_char(erow *row, int at, int c) {
+void row_insert_text(erow *row, ssize_t at, const char *s, ssize_t len) {
+  row_load(row);
+  undo_insert_text(row, at, s, len);
+  row_reserve(row, len);
+  row_move_gap(row, at);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->size += len;
+  update_row_span(row, at, 0, len);
+  E.version++;
+}
+
+void row_delete_text(erow *row, ssize_t at, ssize_t len) {
+  row_load(row);
+  undo_delete_text(row, at, len);
+  row_move_gap(row, at);
+  row->size -= len;
+  update_row_span(row, at, len, 0);
+  E.version++;
+}
+
+void row_insert_char(erow *row, ssize_t at, int c) {
   if (at < 0 || at > row->size) {
     at = row->size;
   }
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  update_row(row);
-  E.dirty = 1;
+  char ch = c;
+  row_insert_text(row, at, &ch, 1);
 }
 
 void append_string_to_row(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  update_row(row);
-  E.dirty = 1;
+  row_insert_text(row, row->size, s, len);
 }
 
-void del_row(int at) {
-  if (at < 0 || at >= E.numrows) {
+void delete_rows(int at, int n) {
+  if (at < 0 || n <= 0 || at + n > E.numrows) {
     return;
   }
-  free(E.row[at].chars);
-  free(E.row[at].render);
-  free(E.row[at].hl);
-  memmove(&E.row[at], &E.row[at + 1], (E.numrows - at - 1) * sizeof(erow));
-  
-  // Update the idx values for all rows after the deleted row
-  for (int j = at; j < E.numrows - 1; j++) {
-    E.row[j].idx = j;
+  erow *prev = at > 0 ? row_at(at - 1) : NULL;
+  erow *last = row_at(at + n - 1);
+  int changed = last->hl_open_comment != (prev && prev->hl_open_comment);
+  undo_delete_rows(at, n);
+  rows_delete(at, n);
+  shift_stale(at, -n);
+  if (changed && at < E.numrows) {
+    row_at(at)->hl_gen = 0;
+    mark_stale(at);
   }
-  
-  E.numrows -= 1;
-  E.dirty = 1;
+  E.version++;
+}
+
+void del_row(int at) { delete_rows(at, 1); }
+
+/* Column mapping
+ *
+ * A shown row of ASCII without tabs maps cx to rx as is. Other shown rows
+ * keep the column of every RX_STRIDE-th byte in their view, worked out
+ * lazily and dropped past an edit, so mapping either way only walks the
+ * bytes after the nearest checkpoint. Rows without a view are walked from
+ * the start. */
+
+/* Tells if the continuation byte at cx belongs to a well-formed character
+ * that starts before it. */
+static int inside_char(const char *s, ssize_t len, ssize_t cx) {
+  for (int j = 1; j <= 3 && j <= cx; j++) {
+    unsigned char c = s[cx - j];
+    if ((c & 0xc0) != 0x80) {
+      int cp;
+      return utf8_decode(&s[cx - j], len - (cx - j), &cp) > j;
+    }
+  }
+  return 0;
+}
+
+/* Columns taken by the byte at s[cx] when it lands on column rx. A character
+ * takes its width at its first byte and none at the rest; bytes that are
+ * not UTF-8 take one column each. */
+static int width_at(const char *s, ssize_t len, ssize_t cx, ssize_t rx) {
+  unsigned char c = s[cx];
+  if (c == '\t') {
+    return TAB_STOP - rx % TAB_STOP;
+  }
+  if (c < 0x80) {
+    return 1;
+  }
+  int cp;
+  if (utf8_decode(&s[cx], len - cx, &cp)) {
+    return utf8_width(cp);
+  }
+  return (c & 0xc0) == 0x80 && inside_char(s, len, cx) ? 0 : 1;
+}
+
+/* The byte after the character at cx and any zero-width ones over it. */
+static ssize_t next_char(erow *row, ssize_t cx) {
+  const char *s = ROW_TEXT(row);
+  for (cx++; cx < row->size && width_at(s, row->size, cx, 0) == 0; cx++)
+    ;
+  return cx;
+}
+
+/* The first byte of the character before cx. */
+static ssize_t prev_char(erow *row, ssize_t cx) {
+  const char *s = ROW_TEXT(row);
+  for (cx--; cx > 0 && width_at(s, row->size, cx, 0) == 0; cx--)
+    ;
+  return cx;
+}
+
+/* Column of byte to, given that byte from starts at column rx. */
+static ssize_t advance(erow *row, ssize_t from, ssize_t to, ssize_t rx) {
+  const char *s = ROW_TEXT(row);
+  for (ssize_t cx = from; cx < to; cx++) {
+    rx += width_at(s, row->size, cx, rx);
+  }
+  return rx;
 }
 
-void row_del_char(erow *row, int at) {
-  if (at < 0 || at >= row->size) {
+/* Makes sure checkpoint k of a shown row is known. */
+static void rx_index(erow *row, ssize_t k) {
+  struct row_view *v = row->view;
+  if (k < v->rx_nckpt) {
     return;
   }
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size -= 1;
-  update_row(row);
-  E.dirty = 1;
+  if (k >= v->rx_ckpt_cap) {
+    v->rx_ckpt_cap = k + 1 > v->rx_ckpt_cap * 2 ? k + 1 : v->rx_ckpt_cap * 2;
+    v->rx_ckpt = realloc(v->rx_ckpt, sizeof(ssize_t) * v->rx_ckpt_cap);
+    if (v->rx_ckpt == NULL) {
+      die("realloc");
+    }
+  }
+  if (v->rx_nckpt == 0) {
+    v->rx_ckpt[0] = 0;
+    v->rx_nckpt = 1;
+  }
+  for (ssize_t i = v->rx_nckpt; i <= k; i++) {
+    v->rx_ckpt[i] = advance(row, (i - 1) * RX_STRIDE, i * RX_STRIDE,
+                            v->rx_ckpt[i - 1]);
+  }
+  v->rx_nckpt = k + 1;
+}
+
+ssize_t cx_to_rx(erow *row, ssize_t cx) {
+  struct row_view *v = row->view;
+  if (v == NULL) {
+    return advance(row, 0, cx, 0);
+  }
+  if (v->plain) {
+    return cx;
+  }
+  ssize_t k = cx / RX_STRIDE;
+  rx_index(row, k);
+  return advance(row, k * RX_STRIDE, cx, v->rx_ckpt[k]);
+}
+
+/* Returns the byte that covers column rx, or size if the row is shorter. */
+ssize_t rx_to_cx(erow *row, ssize_t rx) {
+  struct row_view *v = row->view;
+  ssize_t cx = 0, col = 0;
+  if (v && v->plain) {
+    return rx < row->size ? rx : row->size;
+  }
+  if (v) {
+    // Know checkpoints until one lies past rx or the row ends
+    rx_index(row, 0);
+    while (v->rx_ckpt[v->rx_nckpt - 1] <= rx &&
+           v->rx_nckpt * RX_STRIDE <= row->size) {
+      rx_index(row, v->rx_nckpt);
+    }
+    ssize_t lo = 0, hi = v->rx_nckpt - 1;
+    while (lo < hi) {
+      ssize_t mid = (lo + hi + 1) / 2;
+      if (v->rx_ckpt[mid] <= rx) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    cx = lo * RX_STRIDE;
+    col = v->rx_ckpt[lo];
+  }
+  const char *s = ROW_TEXT(row);
+  while (cx < row->size) {
+    int w = width_at(s, row->size, cx, col);
+    if (col + w > rx) {
+      break;
+    }
+    col += w;
+    cx++;
+  }
+  return cx;
 }
 
 void insert_char(int c) {
   if (E.cy == E.numrows) {
     insert_row(E.numrows, "", 0);
   }
-  row_insert_char(&E.row[E.cy], E.cx++, c);
+  row_insert_char(row_at(E.cy), E.cx++, c);
+}
+
+/* Inserts text at the cursor. Pasted text has \r or \r\n line ends, which
+ * are taken as newlines. A multi-line text splits the cursor row once and
+ * adds every further line with a single insert_rows(), so highlighting and
+ * undo see one edit. */
+void insert_text(const char *s, size_t len) {
+  char *text = malloc(len + 1);
+  if (text == NULL) {
+    die("malloc");
+  }
+  size_t n = 0;
+  int lines = 0;
+  const char *last = text;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] == '\r' || s[i] == '\n') {
+      i += s[i] == '\r' && i + 1 < len && s[i + 1] == '\n';
+      text[n++] = '\n';
+      lines++;
+      last = &text[n];
+    } else {
+      text[n++] = s[i];
+    }
+  }
+  if (E.cy == E.numrows) {
+    insert_row(E.numrows, "", 0);
+  }
+  erow *row = row_at(E.cy);
+  if (lines == 0) {
+    row_insert_text(row, E.cx, text, n);
+    E.cx += n;
+    free(text);
+    return;
+  }
+  // The rest of the row goes after the last line
+  size_t lastlen = &text[n] - last;
+  size_t first = (char *)memchr(text, '\n', n) - text;
+  row_load(row);
+  size_t tail = row->size - E.cx;
+  text = realloc(text, n + tail);
+  if (text == NULL) {
+    die("realloc");
+  }
+  row_copy(row, E.cx, tail, &text[n]);
+  row_delete_text(row, E.cx, tail);
+  row_insert_text(row, E.cx, text, first);
+  insert_rows(E.cy + 1, &text[first + 1], n + tail - first - 1);
+  free(text);
+  E.cy += lines;
+  E.cx = lastlen;
 }
 
 void del_char() {
   if (E.cy == E.numrows) {
     return;
   }
-  erow *row = &E.row[E.cy];
+  erow *row = row_at(E.cy);
   if (E.cx > 0) {
-    row_del_char(row, E.cx - 1);
-    E.cx -= 1;
+    ssize_t at = prev_char(row, E.cx);
+    row_delete_text(row, at, E.cx - at);
+    E.cx = at;
   } else if (E.cx == 0 && E.cy > 0) {
-    E.cx = E.row[E.cy - 1].size;
-    append_string_to_row(&E.row[E.cy - 1], row->chars, row->size);
+    erow *prev = row_prev(row);
+    E.cx = prev->size;
+    append_string_to_row(prev, row_chars(row), row->size);
     del_row(E.cy);
     E.cy -= 1;
   }
 }
 
-char *rows2string(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; ++j) {
-    totlen += E.row[j].size + 1;
-  }
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; ++j) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
-  }
-  return buf;
-}
-
 char *show_prompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128, buflen = 0;
   char *buf = malloc(bufsize);
@@ -408,6 +1137,18 @@ char *show_prompt(char *prompt, void (*callback)(char *, int)) {
         }
         return buf;
       }
+    } else if (c == PASTE) {
+      // Only the first line of a paste goes in the prompt
+      size_t len;
+      const char *text = input_paste(&len);
+      for (size_t i = 0; i < len && text[i] != '\r' && text[i] != '\n'; i++) {
+        if (buflen == bufsize - 1) {
+          bufsize <<= 1;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = text[i];
+      }
+      buf[buflen] = '\0';
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize <<= 1;
@@ -422,81 +1163,58 @@ char *show_prompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
-void save_file() {
-  if (E.filename == NULL) {
-    E.filename = show_prompt("Save as: %s", NULL);
-    if (E.filename == NULL) {
-      set_status_message("Save aborted");
-      return;
-    }
-    select_syntax_highlight();
-  }
-  int len;
-  int err = 0;
-  char *buf = rows2string(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd == -1) {
-    err = 1;
-    goto cleanup;
-  }
-  if (ftruncate(fd, len) == -1) {
-    err = 1;
-    goto cleanup;
+static void update_search_prompt() {
+  snprintf(search_prompt, sizeof(search_prompt),
+           "Search%s%s%s: %%s (ESC/^T case/^W word/^R regex)",
+           search_flags & SEARCH_IGNORE_CASE ? " [nocase]" : "",
+           search_flags & SEARCH_WHOLE_WORD ? " [word]" : "",
+           search_flags & SEARCH_REGEX ? " [regex]" : "");
+}
+
+/* Moves the cursor to the current match, picking the first one if none is
+ * current yet. */
+static void show_match() {
+  if (search.nmatches == 0) {
+    return;
   }
-  if (write(fd, buf, len) != len) {
-    err = 1;
-    goto cleanup;
+  if (search_current == -1) {
+    search_current = 0;
   }
-cleanup:
-  if (err) {
-    set_status_message("Can't save! I/O error: %s", strerror(errno));
-  } else {
-    E.dirty = 0;
-    set_status_message("Wrote %d bytes to disk.", len);
-  }
-  close(fd);
-  free(buf);
+  search_current = (search_current + search.nmatches) % search.nmatches;
+  E.cy = search.matches[search_current].row;
+  E.cx = search.matches[search_current].col;
+  E.rowoff = E.numrows;
 }
 
 void find_callback(char *query, int c) {
-  static int last_match = -1;
-  static int direction = 1;
   if (c == '\r' || c == '\x1b') {
-    last_match = -1;
-    direction = 1;
+    search_current = -1;
+    search_reset(&search);
     return;
   } else if (c == ARROW_DOWN || c == ARROW_RIGHT) {
-    direction = 1;
+    search_current++;
   } else if (c == ARROW_UP || c == ARROW_LEFT) {
-    direction = -1;
+    search_current--;
   } else {
-    direction = 1;
-    last_match = -1;
-  }
-  int i, current = last_match;
-  for (i = 0; i < E.numrows; ++i) {
-    current += direction;
-    if (current == -1) {
-      current = E.numrows - 1;
-    } else if (current == E.numrows) {
-      current = 0;
-    }
-    erow *row = &E.row[current];
-    char *match = strstr(row->chars, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = match - row->chars;
-      E.rowoff = E.numrows;
-      break;
+    if (c == CTRL_KEY('t')) {
+      search_flags ^= SEARCH_IGNORE_CASE;
+    } else if (c == CTRL_KEY('w')) {
+      search_flags ^= SEARCH_WHOLE_WORD;
+    } else if (c == CTRL_KEY('r')) {
+      search_flags ^= SEARCH_REGEX;
     }
+    update_search_prompt();
+    search_start(&search, query, search_flags);
+    search_current = -1;
   }
+  show_match();
 }
 
 void find() {
-  int bkupx = E.cx, bkupy = E.cy;
-  int bkupcoloff = E.coloff, bkuprowoff = E.rowoff;
-  char *query = show_prompt("Search: %s (ESC to cancel)", find_callback);
+  ssize_t bkupx = E.cx, bkupcoloff = E.coloff;
+  int bkupy = E.cy, bkuprowoff = E.rowoff;
+  update_search_prompt();
+  char *query = show_prompt(search_prompt, find_callback);
   if (query) {
     free(query);
   } else {
@@ -508,177 +1226,239 @@ void find() {
 }
 
 int read_key() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1) {
+  int key;
+  while ((key = input_key()) == -1) {
+    // Searching and saving go on in the background while we wait for a key,
+    // and the screen is redrawn as they make progress
+    int busy = E.saving || (search.query && !search.done);
+    search_resume();
+    int events = input_wait(busy ? BACKGROUND_POLL_MS : -1);
+    search_pause();
+    if (events == -1) {
       die("read");
     }
-  }
-  if (c == '\x1b') {
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
-      return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
-      return '\x1b';
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-          case '3':
-            return DEL_KEY;
-          case '5':
-            return PAGE_UP;
-          case '6':
-            return PAGE_DOWN;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-        case 'A':
-          return ARROW_UP;
-        case 'B':
-          return ARROW_DOWN;
-        case 'C':
-          return ARROW_RIGHT;
-        case 'D':
-          return ARROW_LEFT;
-        }
-      }
+    int redraw = events & (INPUT_RESIZE | INPUT_TIMER);
+    if (events & INPUT_RESIZE) {
+      resize_window();
+    }
+    redraw |= save_poll();
+    if (search.query && search_poll(&search)) {
+      show_match();
+      redraw = 1;
+    }
+    if (redraw) {
+      refresh_screen();
     }
   }
-  return c;
-}
-int cx_to_rx(erow *row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (8 - 1) - (rx % 8);
-    rx++;
-  }
-  return rx;
+  return key;
 }
 
 void move_cursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : row_at(E.cy);
+  // Moving up or down keeps the cursor in the same screen column
+  ssize_t rx = row ? cx_to_rx(row, E.cx) : 0;
   switch (key) {
   case ARROW_LEFT:
     if (E.cx > 0) {
-      E.cx--;
+      E.cx = prev_char(row, E.cx);
     } else if (E.cy > 0) {
       E.cy--;
-      E.cx = E.row[E.cy].size;
+      E.cx = row_at(E.cy)->size;
     }
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row->size) {
-      E.cx++;
+      E.cx = next_char(row, E.cx);
     } else if (row && E.cx == row->size) {
       E.cy++;
       E.cx = 0;
     }
     break;
   case ARROW_UP:
-    E.cy--;
-    E.cy = E.cy < 0 ? 0 : E.cy;
-    break;
   case ARROW_DOWN:
-    E.cy++;
-    E.cy = E.cy > E.numrows ? E.numrows : E.cy;
+    E.cy += key == ARROW_UP ? -1 : 1;
+    E.cy = E.cy < 0 ? 0 : E.cy > E.numrows ? E.numrows : E.cy;
+    if (E.cy < E.numrows) {
+      E.cx = rx_to_cx(row_at(E.cy), rx);
+    }
     break;
   }
   
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
+  row = (E.cy >= E.numrows) ? NULL : row_at(E.cy);
+  ssize_t rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
 }
 
-void draw_status_bar(struct abuf *ab) {
-  ab_append(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
+void draw_status_bar() {
+  int y = E.screen_rows;
+  char status[80], rstatus[80], state[20] = "";
+  if (E.saving) {
+    snprintf(state, sizeof(state), "(saving %d%%)", save_progress());
+  } else if (E.version != E.saved_version) {
+    strcpy(state, "(modified)");
+  }
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                     E.syntax ? E.syntax->filetype : "no ft",
-                     E.cy + 1, E.numrows);
+                     E.filename ? E.filename : "[No Name]", E.numrows, state);
+  int rlen;
+  if (PERF_ON()) {
+    rlen = perf_hud(rstatus, sizeof(rstatus));
+  } else if (search.error) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "bad pattern: %s",
+                    search.error);
+  } else if (search.qlen > 0 && search.nmatches == 0) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s",
+                    search.done ? "no matches" : "searching");
+  } else if (search.qlen > 0) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "match %d of %d%s",
+                    search_current + 1, search.nmatches,
+                    search.done ? "" : "+");
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+                    E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                    E.numrows);
+  }
+  if (PERF_ON() && len + rlen > E.screen_cols) {
+    len = E.screen_cols - rlen > 0 ? E.screen_cols - rlen : 0; // timings win
+  }
   if (len > E.screen_cols)
     len = E.screen_cols;
-  ab_append(ab, status, len);
-  while (len < E.screen_cols) {
-    if (E.screen_cols - len == rlen) {
-      ab_append(ab, rstatus, rlen);
-      break;
-    } else {
-      ab_append(ab, " ", 1);
-      len++;
-    }
+  screen_fill(&E.screen, y, 0, COLOR_INVERSE);
+  screen_put(&E.screen, y, 0, status, len, COLOR_INVERSE);
+  if (len + rlen <= E.screen_cols) {
+    screen_put(&E.screen, y, E.screen_cols - rlen, rstatus, rlen,
+               COLOR_INVERSE);
   }
-  ab_append(ab, "\x1b[m", 4);
-  ab_append(ab, "\n\r", 2);
 }
 
-void draw_message_bar(struct abuf *ab) {
-  ab_append(ab, "\x1b[K", 3);
+void draw_message_bar() {
+  int y = E.screen_rows + 1;
+  screen_fill(&E.screen, y, 0, COLOR_DEFAULT);
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screen_cols) {
     msglen = E.screen_cols;
   }
-  if (msglen && time(NULL) - E.statusmsg_time < 5) {
-    ab_append(ab, E.statusmsg, msglen);
-  }
+  screen_put(&E.screen, y, 0, E.statusmsg, msglen, COLOR_DEFAULT);
 }
 
-void draw_rows(struct abuf *ab) {
-  for (int y = E.rowoff; y < E.rowoff + E.screen_rows; ++y) {
-    if (y >= E.numrows) {
-      ab_append(ab, "~", 1);
+/* Colors the search matches on screen over the syntax highlighting. */
+static void draw_matches() {
+  int lo = 0, hi = search.nmatches;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (search.matches[mid].row < E.rowoff) {
+      lo = mid + 1;
     } else {
-      int len = E.row[y].rsize - E.coloff;
-      if (len < 0) {
-        len = 0;
-      }
-      if (len > E.screen_cols) {
-        len = E.screen_cols;
+      hi = mid;
+    }
+  }
+  unsigned char color = syntax_to_color(HL_MATCH);
+  erow *row = NULL;
+  for (int i = lo; i < search.nmatches; i++) {
+    struct search_match m = search.matches[i];
+    int y = m.row - E.rowoff;
+    if (y >= E.screen_rows) {
+      break;
+    }
+    if (row == NULL || row_index(row) != m.row) {
+      row = row_at(m.row);
+    }
+    ssize_t from = cx_to_rx(row, m.col) - E.coloff;
+    ssize_t to = cx_to_rx(row, m.col + m.len) - E.coloff;
+    struct cell *cells = &E.screen.cells[y * E.screen.cols];
+    for (ssize_t x = from < 0 ? 0 : from; x < to && x < E.screen_cols; x++) {
+      cells[x].color = color;
+    }
+  }
+}
+
+/* Draws the part of row that is in view into screen row y and returns the
+ * columns it covers. */
+static int draw_row(erow *row, int y) {
+  struct cell *cells = &E.screen.cells[y * E.screen.cols];
+  const char *s = ROW_TEXT(row);
+  unsigned char *hls = row->view->hl;
+  int hl = -1;
+  unsigned char color = COLOR_DEFAULT;
+  if (row->view->plain) {
+    // A byte per column, so nothing needs decoding
+    ssize_t len = row->size - E.coloff;
+    len = len < 0 ? 0 : len > E.screen_cols ? E.screen_cols : len;
+    for (int x = 0; x < len; x++) {
+      ssize_t cx = E.coloff + x;
+      // Colors are looked up once per run of equally highlighted bytes
+      if (hls[cx] != hl) {
+        hl = hls[cx];
+        color = hl == HL_NORMAL ? COLOR_DEFAULT : syntax_to_color(hl);
       }
-      
-      char *c = &E.row[y].render[E.coloff];
-      unsigned char *hl = &E.row[y].hl[E.coloff];
-      int current_color = -1;
-      
-      for (int j = 0; j < len; j++) {
-        if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            ab_append(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          ab_append(ab, &c[j], 1);
-        } else {
-          int color = syntax_to_color(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            ab_append(ab, buf, clen);
-          }
-          ab_append(ab, &c[j], 1);
+      // Control characters would move the terminal's cursor
+      char c = s[cx];
+      cells[x].ch[0] = (unsigned char)c < 32 || c == 127 ? '?' : c;
+      cells[x].len = 1;
+      cells[x].color = color;
+    }
+    return len;
+  }
+
+  // Start at the character under the left edge, which may stick out of it
+  ssize_t cx = rx_to_cx(row, E.coloff);
+  ssize_t rx = cx_to_rx(row, cx);
+  ssize_t end = E.coloff + E.screen_cols;
+  while (cx < row->size && rx < end) {
+    if (hls[cx] != hl) {
+      hl = hls[cx];
+      color = hl == HL_NORMAL ? COLOR_DEFAULT : syntax_to_color(hl);
+    }
+    int w = width_at(s, row->size, cx, rx);
+    int cp, n = utf8_decode(&s[cx], row->size - cx, &cp);
+    if (n > 0 && cp >= 32 && (cp < 127 || cp >= 160) && rx >= E.coloff) {
+      screen_glyph(&E.screen, y, rx - E.coloff, &s[cx], n, w, color);
+    } else {
+      // Tabs and wide characters cut by the left edge show as blanks, and
+      // control characters and bytes that are not UTF-8 as '?'
+      char c = n > 0 && (cp == '\t' || cp >= 160) ? ' ' : '?';
+      for (int i = 0; i < w; i++) {
+        if (rx + i >= E.coloff && rx + i < end) {
+          screen_glyph(&E.screen, y, rx + i - E.coloff, &c, 1, 1, color);
         }
       }
-      ab_append(ab, "\x1b[39m", 5);
     }
-    ab_append(ab, "\x1b[K", 3);
-    ab_append(ab, "\r\n", 2);
+    rx += w;
+    cx += n > 0 ? n : 1;
   }
+  return rx > E.coloff ? (rx < end ? rx : end) - E.coloff : 0;
+}
+
+void draw_rows() {
+  view_trim();
+  highlight_rows(E.rowoff, E.screen_rows + HL_MARGIN_ROWS);
+  
+  erow *row = row_at(E.rowoff);
+  for (int y = 0; y < E.screen_rows; y++) {
+    int len = 0;
+    if (row == NULL) {
+      len = screen_glyph(&E.screen, y, 0, "~", 1, 1, COLOR_DEFAULT);
+    } else {
+      len = draw_row(row, y);
+      row = row_next(row);
+    }
+    screen_fill(&E.screen, y, len, COLOR_DEFAULT);
+  }
+  draw_matches();
 }
 
 void scroll() {
   E.rx = 0;
+  // Columns to keep in view: a wide character under the cursor is shown whole
+  int w = 1;
   if (E.cy < E.numrows) {
-    E.rx = cx_to_rx(&E.row[E.cy], E.cx);
+    erow *row = row_at(E.cy);
+    const char *s = ROW_TEXT(row);
+    E.rx = cx_to_rx(row, E.cx);
+    if (E.cx < row->size && s[E.cx] != '\t') {
+      w = width_at(s, row->size, E.cx, E.rx) > 1 ? 2 : 1;
+    }
   }
   
   if (E.cy < E.rowoff) {
@@ -689,26 +1469,30 @@ void scroll() {
 
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
-  } else if (E.rx >= E.coloff + E.screen_cols) {
-    E.coloff = E.rx - E.screen_cols + 1;
+  } else if (E.rx + w > E.coloff + E.screen_cols) {
+    E.coloff = E.rx + w - E.screen_cols;
   }
 }
 
 void refresh_screen() {
+  double t = PERF_BEGIN();
   scroll();
-  struct abuf ab = ABUF_INIT;
-  ab_append(&ab, "\x1b[?25l", 6); // Hide cursor
-  ab_append(&ab, "\x1b[H", 3);
-  draw_rows(&ab);
-  draw_status_bar(&ab);
-  draw_message_bar(&ab);
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
-  ab_append(&ab, buf, strlen(buf));
-  ab_append(&ab, "\x1b[?25h", 6); // Show cursor
-  write(STDOUT_FILENO, ab.b, ab.len);
-  ab_free(&ab);
+  draw_rows();
+  draw_status_bar();
+  draw_message_bar();
+  ab_reset(&E.frame);
+  screen_flush(&E.screen, &E.frame, E.cy - E.rowoff, E.rx - E.coloff);
+  PERF_END(PERF_FRAME, t);
+  t = PERF_BEGIN();
+  term_flush(&E.frame);
+  PERF_END(PERF_WRITE, t);
+}
+
+static int message_timer = -1;
+
+static void expire_message() {
+  E.statusmsg[0] = '\0';
+  message_timer = -1;
 }
 
 void set_status_message(const char *fmt, ...) {
@@ -716,7 +1500,8 @@ void set_status_message(const char *fmt, ...) {
   va_start(ap, fmt);
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap);
-  E.statusmsg_time = time(NULL);
+  timer_cancel(message_timer);
+  message_timer = timer_add(STATUS_MESSAGE_MS, expire_message);
 }
 
 /* Syntax highlighting functions */
@@ -741,22 +1526,40 @@ int syntax_to_color(int hl) {
 void process_key_press() {
   static int quit_times = 1;
   int c = read_key();
+  undo_begin();
   switch (c) {
   case ESCAPE:
   case CTRL_KEY('l'):
     break;
   case CTRL_KEY('q'):
-    if (E.dirty && quit_times > 0) {
+    if (E.version != E.saved_version && quit_times > 0) {
       set_status_message("Unsaved changes! Press Ctrl+q again to quit.");
       quit_times--;
       return;
     }
+    if (E.saving) {
+      set_status_message("Waiting for the save to finish...");
+      refresh_screen();
+      save_wait();
+    }
     clear_screen();
     exit(0);
     break;
   case CTRL_KEY('s'):
     save_file();
     break;
+  case CTRL_KEY('p'):
+    perf_enable(!PERF_ON());
+    break;
+  case CTRL_KEY('e'): {
+    const char *path = perf_trace_path();
+    int n = perf_export(path);
+    if (n == -1) {
+      set_status_message("Can't write trace! I/O error: %s", strerror(errno));
+    } else {
+      set_status_message("Wrote %d spans to %s", n, path);
+    }
+  } break;
   case '\r':
   case '\n':
     insert_enter();
@@ -772,6 +1575,17 @@ void process_key_press() {
   case CTRL_KEY('f'):
     find();
     break;
+  case PASTE: {
+    size_t len;
+    const char *text = input_paste(&len);
+    insert_text(text, len);
+  } break;
+  case CTRL_KEY('z'):
+    undo();
+    break;
+  case CTRL_KEY('y'):
+    redo();
+    break;
   case ARROW_DOWN:
   case ARROW_UP:
   case ARROW_RIGHT:
@@ -5,16 +5,21 @@
 #define _BSD_SOURCE
 
 #include "append_buf.h"
+#include "screen.h"
 #include "terminal.h"
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -35,6 +40,37 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// How long a status message stays up, and how often the screen is refreshed
+// while a search or a save runs in the background
+#define STATUS_MESSAGE_MS 5000
+#define BACKGROUND_POLL_MS 100
+// Build with e.g. -DFRAME_MIN_MS=16 to keep taking keys that arrive within
+// that long of the last frame before drawing the next one
+#ifndef FRAME_MIN_MS
+#define FRAME_MIN_MS 0
+#endif
+
+#define TAB_STOP 8
+// Bytes between the column checkpoints that map cx to rx and back
+#define RX_STRIDE 128
+
+#define HL_SYNC_ROWS 1000
+#define HL_MARGIN_ROWS 16
+// Documents up to this many rows are highlighted in full when their syntax
+// is picked, so comment state is right everywhere and not only near the
+// rows shown; full highlighting splits the rows among up to HL_MAX_THREADS
+// threads, HL_CHUNK_ROWS or more each
+#define HL_FULL_ROWS 250000
+#define HL_MAX_THREADS 8
+#define HL_CHUNK_ROWS 4096
+
+// Slices handed to one writev when saving
+#define SAVE_IOVECS 1024
+// Build with -DSAVE_FSYNC=0 to skip flushing saves to disk
+#ifndef SAVE_FSYNC
+#define SAVE_FSYNC 1
+#endif
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -43,30 +79,68 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  struct keyword_matcher *matcher;
 };
 
+struct hl_state {
+  char in_string;
+  char in_comment;
+  char prev_sep;
+  unsigned char prev_hl;
+};
+
+struct hl_checkpoint {
+  ssize_t pos;
+  struct hl_state st;
+};
+
+struct row_view;
+
+/* Offsets and lengths within a row are ssize_t, since one line of a mapped
+ * file can be longer than an int reaches. Rows are counted in ints, as 2^31
+ * of them would take hundreds of gigabytes of erows. */
 typedef struct erow {
-  int idx;
-  int size;
-  int rsize;
+  struct erow *left, *right, *parent;
+  ssize_t size;
+  ssize_t cap, gap;
   char *chars;
-  char *render;
-  unsigned char *hl;
+  const char *src;
+  struct row_view *view; // set while the row is shown, see view.h
+  int count;
+  int loaded; // rows in this subtree whose chars are allocated
+  unsigned int hl_gen;
+  unsigned int frozen; // save epoch whose snapshot holds chars
   int hl_open_comment;
 } erow;
 
+#define GAP_LEN(row) ((row)->cap - (row)->size)
+// The gap of a loaded row is kept at its end between edits, so its text is
+// contiguous like that of a row still in the mapping
+#define ROW_TEXT(row) ((row)->chars ? (const char *)(row)->chars : (row)->src)
+
 struct editor_config {
-  int cx, cy;
-  int rx;
-  int rowoff, coloff;
+  ssize_t cx;
+  int cy;
+  ssize_t rx;
+  int rowoff;
+  ssize_t coloff;
   int screen_rows, screen_cols;
+  struct screen screen;
+  struct abuf frame;
   int numrows;
-  int dirty;
-  erow *row;
+  unsigned long version, saved_version; // bumped by every edit
+  int saving;
+  unsigned int save_epoch;
+  erow *doc;
+  char *map;
+  size_t map_len;
+  int map_crlf; // some line in the mapping ends in \r
+  int map_gaps; // a run of unloaded rows skips over bytes of the mapping
   char *filename;
   char statusmsg[80];
-  time_t statusmsg_time;
   struct editorSyntax *syntax;
+  unsigned int hl_gen;
+  int hl_stale; // rows from here on may follow a comment state that changed
   struct termios orig_termois;
 };
 
@@ -82,21 +156,41 @@ enum editorKey {
   PAGE_UP,
   PAGE_DOWN,
   DEL_KEY,
+  PASTE,
 };
 
 void init();
 int read_key();
-void draw_rows(struct abuf *ab);
+void draw_rows();
+void draw_status_bar();
+void draw_message_bar();
 void refresh_screen();
 void process_key_press();
 void move_cursor(int key);
+ssize_t cx_to_rx(erow *row, ssize_t cx);
+ssize_t rx_to_cx(erow *row, ssize_t rx);
 void open_file(char *filename);
 void insert_row(int at, char *s, size_t len);
+void insert_rows(int at, const char *text, size_t len);
+void insert_text(const char *s, size_t len);
+void delete_rows(int at, int n);
+void row_insert_text(erow *row, ssize_t at, const char *s, ssize_t len);
+void row_delete_text(erow *row, ssize_t at, ssize_t len);
+void row_load(erow *row);
 void set_status_message(const char *fmt, ...);
+char *show_prompt(char *prompt, void (*callback)(char *, int));
 void update_syntax(erow *row);
+void update_syntax_span(erow *row, ssize_t at, ssize_t removed,
+                        ssize_t inserted);
+void highlight_rows(int at, int n);
+void highlight_all(int threads);
 int syntax_to_color(int hl);
 void select_syntax_highlight();
 int is_separator(int c);
 void update_row(erow *row);
+void update_row_span(erow *row, ssize_t at, ssize_t removed,
+                     ssize_t inserted);
+char *row_chars(erow *row);
+void row_copy(erow *row, ssize_t at, ssize_t len, char *dst);
 
 #endif
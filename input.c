@@ -0,0 +1,317 @@
+#include "input.h"
+#include <poll.h>
+#include <signal.h>
+
+// Bracketed paste wraps pasted text in these
+#define PASTE_START -2
+static const char paste_end[] = "\x1b[201~";
+
+static struct {
+  unsigned char buf[INPUT_BUF_SIZE];
+  int start, len; // bytes not decoded yet
+  int esc_expired;
+  int pasting;
+  struct abuf paste;
+  int wake[2];    // written to by input_wake()
+  volatile sig_atomic_t resized;
+} in;
+
+static struct {
+  double when;
+  void (*fn)();
+} timers[INPUT_MAX_TIMERS];
+
+/* Ends the wait in input_wait() early. Safe to call from other threads and
+ * signal handlers. */
+void input_wake() {
+  int err = errno;
+  write(in.wake[1], "", 1);
+  errno = err;
+}
+
+static void on_resize(int sig) {
+  (void)sig;
+  in.resized = 1;
+  input_wake();
+}
+
+void input_init() {
+  if (pipe(in.wake) == -1) {
+    die("pipe");
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(in.wake[i], F_SETFL, O_NONBLOCK);
+    fcntl(in.wake[i], F_SETFD, FD_CLOEXEC);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_resize;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, NULL);
+}
+
+/* Decodes the key at the start of p, or returns -1 if p ends partway
+ * through an escape sequence. */
+static int decode(const unsigned char *p, int n, int *used) {
+  *used = 1;
+  if (p[0] != '\x1b') {
+    return p[0];
+  }
+  if (n < 2) {
+    return -1;
+  }
+  *used = 2;
+  if (p[1] == 'O') {
+    if (n < 3) {
+      return -1;
+    }
+    *used = 3;
+    switch (p[2]) {
+    case 'A':
+      return ARROW_UP;
+    case 'B':
+      return ARROW_DOWN;
+    case 'C':
+      return ARROW_RIGHT;
+    case 'D':
+      return ARROW_LEFT;
+    }
+    return ESCAPE;
+  }
+  if (p[1] != '[') {
+    return ESCAPE;
+  }
+  // A control sequence: parameter and intermediate bytes, then a final byte
+  int i = 2;
+  while (i < n && p[i] >= 0x20 && p[i] <= 0x3f) {
+    i++;
+  }
+  if (i == n) {
+    return -1;
+  }
+  *used = i + 1;
+  switch (p[i]) {
+  case 'A':
+    return ARROW_UP;
+  case 'B':
+    return ARROW_DOWN;
+  case 'C':
+    return ARROW_RIGHT;
+  case 'D':
+    return ARROW_LEFT;
+  case '~': {
+    int param = 0;
+    for (int j = 2; j < i && isdigit(p[j]); j++) {
+      param = param * 10 + p[j] - '0';
+    }
+    switch (param) {
+    case 3:
+      return DEL_KEY;
+    case 5:
+      return PAGE_UP;
+    case 6:
+      return PAGE_DOWN;
+    case 200:
+      return PASTE_START;
+    }
+  } break;
+  }
+  return ESCAPE;
+}
+
+static void consume(int n) {
+  in.start += n;
+  in.len -= n;
+}
+
+/* Moves pasted bytes out of the input buffer up to the end marker, keeping
+ * back what may be the start of a marker split across reads. Returns PASTE
+ * once the marker arrived, or once the start of one was kept back until the
+ * escape timeout, which is taken as a marker cut short. */
+static int paste_key() {
+  const char *p = (const char *)&in.buf[in.start];
+  int n = in.len, i = 0;
+  const char *esc;
+  while ((esc = memchr(&p[i], '\x1b', n - i))) {
+    i = esc - p;
+    int m = n - i < (int)sizeof(paste_end) - 1 ? n - i : (int)sizeof(paste_end) - 1;
+    if (memcmp(esc, paste_end, m) == 0) {
+      break;
+    }
+    i++;
+  }
+  if (esc == NULL) {
+    i = n;
+  }
+  ab_append(&in.paste, p, i);
+  consume(i);
+  int expired = in.esc_expired;
+  in.esc_expired = 0;
+  if (in.len >= (int)sizeof(paste_end) - 1 || (in.len > 0 && expired)) {
+    consume(in.len < (int)sizeof(paste_end) - 1 ? in.len
+                                                 : (int)sizeof(paste_end) - 1);
+    in.pasting = 0;
+    return PASTE;
+  }
+  return -1;
+}
+
+/* The text of the last PASTE key. */
+const char *input_paste(size_t *len) {
+  *len = in.paste.len;
+  return in.paste.b;
+}
+
+/* Returns the next buffered key, or -1 if there is none yet. */
+int input_key() {
+  if (in.pasting) {
+    return paste_key();
+  }
+  if (in.len == 0) {
+    return -1;
+  }
+  const unsigned char *p = &in.buf[in.start];
+  int used, key = decode(p, in.len, &used);
+  if (key == -1) {
+    if (!in.esc_expired && in.len < INPUT_BUF_SIZE) {
+      return -1;
+    }
+    key = ESCAPE;
+    used = 1;
+  }
+  in.esc_expired = 0;
+  consume(used);
+  if (key == PASTE_START) {
+    in.pasting = 1;
+    ab_reset(&in.paste);
+    return paste_key();
+  }
+  return key;
+}
+
+static int fill() {
+  memmove(in.buf, &in.buf[in.start], in.len);
+  in.start = 0;
+  ssize_t n = term_read(&in.buf[in.len], INPUT_BUF_SIZE - in.len);
+  if (n == 0) {
+    errno = EIO; // the terminal hung up
+    return -1;
+  }
+  if (n == -1 && errno != EAGAIN && errno != EINTR) {
+    return -1;
+  }
+  if (n > 0) {
+    in.len += n;
+  }
+  return 0;
+}
+
+/* Whether more input is buffered or arrives within timeout_ms. */
+int input_pending(int timeout_ms) {
+  if (in.len > 0) {
+    return 1;
+  }
+  if (term_queued()) {
+    return fill() == 0 && in.len > 0;
+  }
+  struct pollfd fd = {term_fd(), POLLIN, 0};
+  return poll(&fd, 1, timeout_ms) > 0 && fill() == 0 && in.len > 0;
+}
+
+static int next_timer_ms() {
+  double now = now_ms();
+  int ms = -1;
+  for (int i = 0; i < INPUT_MAX_TIMERS; i++) {
+    if (timers[i].fn) {
+      int left = timers[i].when > now ? timers[i].when - now + 1 : 0;
+      if (ms == -1 || left < ms) {
+        ms = left;
+      }
+    }
+  }
+  return ms;
+}
+
+static int run_timers() {
+  double now = now_ms();
+  int fired = 0;
+  for (int i = 0; i < INPUT_MAX_TIMERS; i++) {
+    if (timers[i].fn && timers[i].when <= now) {
+      void (*fn)() = timers[i].fn;
+      timers[i].fn = NULL;
+      fn();
+      fired = 1;
+    }
+  }
+  return fired;
+}
+
+/* Waits up to timeout_ms, or for good if it is -1, for input, a resize or
+ * a due timer, runs the timers that are due and reads what input there is. */
+int input_wait(int timeout_ms) {
+  // A headless terminal is asked for more keys when there is nothing else
+  // to wait for, and keys fed to it are there already
+  if (timeout_ms == -1 && in.len == 0) {
+    term_idle();
+  }
+  int queued = term_queued() > 0;
+  if (queued) {
+    timeout_ms = 0;
+  }
+  int ms = next_timer_ms();
+  if (ms != -1 && (timeout_ms == -1 || ms < timeout_ms)) {
+    timeout_ms = ms;
+  }
+  int partial = in.len > 0;
+  if (partial && (timeout_ms == -1 || timeout_ms > INPUT_ESC_MS)) {
+    timeout_ms = INPUT_ESC_MS;
+  }
+  struct pollfd fds[2] = {{term_fd(), POLLIN, 0}, {in.wake[0], POLLIN, 0}};
+  int n = poll(fds, 2, timeout_ms);
+  if (n == -1 && errno != EINTR) {
+    return -1;
+  }
+  int events = 0;
+  if (n > 0 && fds[1].revents) {
+    char drain[64];
+    while (read(in.wake[0], drain, sizeof(drain)) > 0) {
+    }
+  }
+  if (in.resized) {
+    in.resized = 0;
+    events |= INPUT_RESIZE;
+  }
+  if ((n > 0 && fds[0].revents) || queued) {
+    if (fill() == -1) {
+      return -1;
+    }
+    events |= INPUT_KEYS;
+  } else if (n == 0 && partial) {
+    in.esc_expired = 1;
+    events |= INPUT_KEYS;
+  }
+  if (run_timers()) {
+    events |= INPUT_TIMER;
+  }
+  return events;
+}
+
+/* Calls fn from the event loop once ms have passed. Returns an id for
+ * timer_cancel(), or -1 if every slot is taken. */
+int timer_add(int ms, void (*fn)()) {
+  for (int i = 0; i < INPUT_MAX_TIMERS; i++) {
+    if (timers[i].fn == NULL) {
+      timers[i].when = now_ms() + ms;
+      timers[i].fn = fn;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void timer_cancel(int id) {
+  if (id >= 0) {
+    timers[id].fn = NULL;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef INPUT
+#define INPUT
+
+#include "editor.h"
+
+/* The event loop. Input is read in whole batches into a buffer that keys
+ * are decoded from, and waiting blocks in poll() on the terminal until a
+ * key, a resize or a timer is due, so the editor uses no CPU while idle.
+ * Background work wakes it with input_wake() once it finishes. Text pasted
+ * in bracketed paste mode arrives as one PASTE key. */
+
+#define INPUT_BUF_SIZE 4096
+// How long to wait for the rest of an escape sequence before taking a lone
+// escape as the key
+#define INPUT_ESC_MS 50
+#define INPUT_MAX_TIMERS 8
+
+// What input_wait() saw, or -1 if reading failed
+#define INPUT_KEYS 1
+#define INPUT_RESIZE 2
+#define INPUT_TIMER 4
+
+void input_init();
+int input_key();
+const char *input_paste(size_t *len);
+int input_wait(int timeout_ms);
+int input_pending(int timeout_ms);
+void input_wake();
+int timer_add(int ms, void (*fn)());
+void timer_cancel(int id);
+
+#endif
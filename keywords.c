@@ -0,0 +1,69 @@
+#include "keywords.h"
+
+struct keyword_matcher *compile_keywords(char **keywords) {
+  struct keyword_matcher *m = calloc(1, sizeof(struct keyword_matcher));
+  if (m == NULL) {
+    die("calloc");
+  }
+  int total = 0;
+  m->nclasses = 1;
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    if (klen > 0 && keywords[j][klen - 1] == '|') klen--;
+    for (int i = 0; i < klen; i++) {
+      unsigned char c = keywords[j][i];
+      if (m->classes[c] == 0) {
+        m->classes[c] = m->nclasses++;
+      }
+    }
+    if (klen > m->maxlen) m->maxlen = klen;
+    total += klen;
+  }
+  
+  // Node 0 is the root; no transition leads back to it, so 0 also means none
+  m->next = calloc((total + 1) * m->nclasses, sizeof(int));
+  m->type = calloc(total + 1, 1);
+  if (m->next == NULL || m->type == NULL) {
+    die("calloc");
+  }
+  int nodes = 1;
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    int kw2 = klen > 0 && keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    if (klen == 0) continue;
+    
+    int node = 0;
+    for (int i = 0; i < klen; i++) {
+      int *edge = &m->next[node * m->nclasses +
+                           m->classes[(unsigned char)keywords[j][i]]];
+      if (*edge == 0) {
+        *edge = nodes++;
+      }
+      node = *edge;
+    }
+    if (m->type[node] == HL_NORMAL) { // Earlier entries win, as before
+      m->type[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+  }
+  return m;
+}
+
+/* Returns the highlight of the keyword that s starts with, or HL_NORMAL. A
+ * keyword only counts when a separator or the end of s follows it. */
+int match_keyword(struct keyword_matcher *m, const char *s, ssize_t len,
+                  int *klen) {
+  int node = 0;
+  for (ssize_t i = 0; i < len; i++) {
+    node = m->next[node * m->nclasses + m->classes[(unsigned char)s[i]]];
+    if (node == 0) {
+      return HL_NORMAL;
+    }
+    if (m->type[node] != HL_NORMAL &&
+        (i + 1 == len || is_separator(s[i + 1]))) {
+      *klen = i + 1;
+      return m->type[node];
+    }
+  }
+  return HL_NORMAL;
+}
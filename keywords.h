@@ -0,0 +1,21 @@
+#ifndef KEYWORDS
+#define KEYWORDS
+
+#include "editor.h"
+
+/* A syntax's keyword list compiled into a trie over byte classes: bytes that
+ * appear in no keyword share the dead class, so the table stays small and an
+ * identifier is classified in one pass over its bytes. */
+struct keyword_matcher {
+  unsigned char classes[256];
+  int nclasses;
+  int *next;
+  unsigned char *type;
+  int maxlen;
+};
+
+struct keyword_matcher *compile_keywords(char **keywords);
+int match_keyword(struct keyword_matcher *m, const char *s, ssize_t len,
+                  int *klen);
+
+#endif
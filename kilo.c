@@ -1,14 +1,29 @@
 #include "editor.h"
+#include "input.h"
+#include "perf.h"
+
+static void write_trace() { perf_export(perf_trace_path()); }
 
 int main(int argc, char *argv[]) {
   init();
+  if (getenv("KILO_TRACE")) {
+    perf_enable(1);
+    atexit(write_trace);
+  }
   if (argc >= 2) {
     open_file(argv[1]);
   }
   set_status_message("This ain't vim! Hit Ctrl+q to exit.");
   while (1) {
     refresh_screen();
-    process_key_press();
+    double frame = now_ms();
+    // Every key that is already waiting is handled before the next frame,
+    // so a burst of input costs one frame rather than one per key
+    int left;
+    do {
+      process_key_press();
+      left = FRAME_MIN_MS - (now_ms() - frame);
+    } while (input_pending(left > 0 ? left : 0));
   }
   return 0;
 }
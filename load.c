@@ -0,0 +1,144 @@
+#include "load.h"
+#include "document.h"
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct chunk {
+  const char *start, *end; // whole lines, the last maybe without a newline
+  erow *rows;
+  int nrows;
+  erow *tree;
+  int crlf;
+};
+
+#ifdef __SSE2__
+/* Bit i is set if p[i] is a newline, for 64 bytes. */
+static unsigned long long newline_mask(const char *p) {
+  __m128i nl = _mm_set1_epi8('\n');
+  unsigned long long mask = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&p[i * 16]);
+    mask |= (unsigned long long)(unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, nl))
+            << (i * 16);
+  }
+  return mask;
+}
+#endif
+
+size_t count_newlines(const char *p, const char *end) {
+  size_t n = 0;
+#ifdef __SSE2__
+  for (; end - p >= 64; p += 64) {
+    n += __builtin_popcountll(newline_mask(p));
+  }
+#endif
+  for (; p < end; p++) {
+    n += *p == '\n';
+  }
+  return n;
+}
+
+/* Sets up a row for the line [p, nl), trimming \r line ends the same way
+ * reading a line from a stream does. */
+static void add_line(struct chunk *c, erow *row, const char *p,
+                     const char *nl) {
+  ssize_t len = nl - p;
+  while (len > 0 && p[len - 1] == '\r') {
+    len--;
+    c->crlf = 1;
+  }
+  row->size = len;
+  row->src = p;
+}
+
+static void *index_chunk(void *arg) {
+  struct chunk *c = arg;
+  const char *p = c->start, *end = c->end, *line = p;
+  size_t nrows = count_newlines(p, end) + (end > p && end[-1] != '\n');
+  if (nrows > INT_MAX) {
+    errno = EFBIG;
+    die("too many lines");
+  }
+  c->nrows = nrows;
+  // Fresh zeroed pages, so rows start out cleared without a pass over them
+  c->rows = calloc(c->nrows ? c->nrows : 1, sizeof(erow));
+  if (c->rows == NULL) {
+    die("calloc");
+  }
+  erow *row = c->rows;
+#ifdef __SSE2__
+  for (; end - p >= 64; p += 64) {
+    for (unsigned long long mask = newline_mask(p); mask; mask &= mask - 1) {
+      const char *nl = p + __builtin_ctzll(mask);
+      add_line(c, row++, line, nl);
+      line = nl + 1;
+    }
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == '\n') {
+      add_line(c, row++, line, p);
+      line = p + 1;
+    }
+  }
+  if (line < end) {
+    add_line(c, row++, line, end);
+  }
+  c->tree = rows_build(c->rows, c->nrows);
+  return NULL;
+}
+
+/* Appends a row for every line of buf, on up to threads threads, or on one
+ * per CPU if threads is 0. */
+void index_lines(const char *buf, size_t len, int threads) {
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > LOAD_MAX_THREADS) {
+    threads = LOAD_MAX_THREADS;
+  }
+  if ((size_t)threads > len / LOAD_MIN_CHUNK) {
+    threads = len / LOAD_MIN_CHUNK > 0 ? len / LOAD_MIN_CHUNK : 1;
+  }
+
+  struct chunk chunks[LOAD_MAX_THREADS];
+  pthread_t tids[LOAD_MAX_THREADS];
+  const char *end = buf + len, *p = buf;
+  int n = 0;
+  for (int i = 0; i < threads && p < end; i++) {
+    const char *stop = i == threads - 1 ? end : buf + len / threads * (i + 1);
+    if (stop < p) {
+      stop = p;
+    }
+    const char *nl = memchr(stop, '\n', end - stop);
+    stop = nl ? nl + 1 : end;
+    memset(&chunks[n], 0, sizeof(struct chunk));
+    chunks[n].start = p;
+    chunks[n].end = stop;
+    n++;
+    p = stop;
+  }
+  for (int i = 1; i < n; i++) {
+    if (pthread_create(&tids[i], NULL, index_chunk, &chunks[i]) != 0) {
+      index_chunk(&chunks[i]);
+      tids[i] = pthread_self();
+    }
+  }
+  if (n > 0) {
+    index_chunk(&chunks[0]);
+  }
+  for (int i = 0; i < n; i++) {
+    if (i > 0 && !pthread_equal(tids[i], pthread_self())) {
+      pthread_join(tids[i], NULL);
+    }
+    if (chunks[i].nrows > INT_MAX - E.numrows) {
+      errno = EFBIG;
+      die("too many lines");
+    }
+    rows_insert_tree(E.numrows, chunks[i].tree);
+    E.map_crlf |= chunks[i].crlf;
+  }
+}
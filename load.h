@@ -0,0 +1,17 @@
+#ifndef LOAD
+#define LOAD
+
+#include "editor.h"
+
+/* Indexing of a mapped file into rows. The file is cut into chunks at line
+ * boundaries that threads scan for newlines, build rows and a subtree for,
+ * after which the subtrees are joined in order. */
+
+#define LOAD_MAX_THREADS 8
+// Files are not split into chunks smaller than this
+#define LOAD_MIN_CHUNK (1 << 20)
+
+size_t count_newlines(const char *p, const char *end);
+void index_lines(const char *buf, size_t len, int threads);
+
+#endif
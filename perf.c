@@ -0,0 +1,147 @@
+#include "perf.h"
+#include <pthread.h>
+
+#define PERF_MAX_THREADS 16
+
+int perf_on;
+
+static const char *span_names[PERF_SPANS] = {
+    "load", "highlight", "frame", "write", "search", "snapshot", "save"};
+// Shorter, for the status bar
+static const char *hud_names[PERF_SPANS] = {"load", "hl",   "frame", "write",
+                                            "find", "snap", "save"};
+
+struct perf_event {
+  double start, dur; // microseconds
+  unsigned char span, thread;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  struct perf_event *events; // a ring of the last PERF_EVENTS
+  long long n;
+  double recent[PERF_SPANS][PERF_WINDOW];
+  int nrecent[PERF_SPANS];
+  pthread_t threads[PERF_MAX_THREADS];
+  int nthreads;
+} perf;
+
+/* Microseconds on the monotonic clock. */
+double perf_now() { return now_ms() * 1e3; }
+
+/* A small number for the calling thread; the editor's is 0. */
+static int thread_index() {
+  pthread_t self = pthread_self();
+  for (int i = 0; i < perf.nthreads; i++) {
+    if (pthread_equal(perf.threads[i], self)) {
+      return i;
+    }
+  }
+  if (perf.nthreads == PERF_MAX_THREADS) {
+    return PERF_MAX_THREADS - 1;
+  }
+  perf.threads[perf.nthreads] = self;
+  return perf.nthreads++;
+}
+
+void perf_record(enum perf_span span, double start) {
+  double dur = perf_now() - start;
+  pthread_mutex_lock(&lock);
+  if (perf.events) {
+    struct perf_event *ev = &perf.events[perf.n++ % PERF_EVENTS];
+    ev->start = start;
+    ev->dur = dur;
+    ev->span = span;
+    ev->thread = thread_index();
+    perf.recent[span][perf.nrecent[span]++ % PERF_WINDOW] = dur;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* Turns timing on or off. Turning it on starts over from no spans. */
+void perf_enable(int on) {
+  if (on && !PERF_ON()) {
+    pthread_mutex_lock(&lock);
+    if (perf.events == NULL) {
+      perf.events = malloc(sizeof(struct perf_event) * PERF_EVENTS);
+      if (perf.events == NULL) {
+        die("malloc");
+      }
+    }
+    perf.n = 0;
+    memset(perf.nrecent, 0, sizeof(perf.nrecent));
+    // The thread turning timing on is the editor's
+    perf.threads[0] = pthread_self();
+    perf.nthreads = 1;
+    pthread_mutex_unlock(&lock);
+  }
+  // The ring is guarded by the lock, so the flag needs no ordering of its own
+  __atomic_store_n(&perf_on, on, __ATOMIC_RELAXED);
+}
+
+/* Writes the slowest recent span of each kind that has run, in ms, into
+ * buf and returns its length. */
+int perf_hud(char *buf, int len) {
+  int n = 0;
+  buf[0] = '\0';
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < PERF_SPANS && n < len; i++) {
+    int m = perf.nrecent[i] < PERF_WINDOW ? perf.nrecent[i] : PERF_WINDOW;
+    if (m == 0) {
+      continue;
+    }
+    double max = 0;
+    for (int j = 0; j < m; j++) {
+      max = perf.recent[i][j] > max ? perf.recent[i][j] : max;
+    }
+    max /= 1e3;
+    n += snprintf(&buf[n], len - n, "%s%s %.*f", n ? " " : "", hud_names[i],
+                  max < 10 ? 2 : max < 100 ? 1 : 0, max);
+  }
+  pthread_mutex_unlock(&lock);
+  if (n == 0) {
+    n = snprintf(buf, len, "perf: no spans yet");
+  } else if (n < len) {
+    n += snprintf(&buf[n], len - n, " ms");
+  }
+  return n < len ? n : len - 1;
+}
+
+/* Writes the recorded spans to path in the Chrome trace event format.
+ * Returns the number written, or -1 with errno set. */
+int perf_export(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&lock);
+  long long first = perf.n > PERF_EVENTS ? perf.n - PERF_EVENTS : 0;
+  int written = perf.n - first;
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (int i = 0; i < perf.nthreads; i++) {
+    fprintf(fp,
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s %d\"}}%s\n",
+            i, i ? "worker" : "editor", i,
+            i + 1 < perf.nthreads || first < perf.n ? "," : "");
+  }
+  for (long long i = first; i < perf.n; i++) {
+    struct perf_event *ev = &perf.events[i % PERF_EVENTS];
+    fprintf(fp,
+            "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f}%s\n",
+            span_names[ev->span], ev->thread, ev->start, ev->dur,
+            i + 1 < perf.n ? "," : "");
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+  pthread_mutex_unlock(&lock);
+  if (fclose(fp) == EOF) {
+    return -1;
+  }
+  return written;
+}
+
+const char *perf_trace_path() {
+  const char *path = getenv("KILO_TRACE");
+  return path && *path ? path : PERF_TRACE_FILE;
+}
@@ -0,0 +1,52 @@
+#ifndef PERF
+#define PERF
+
+#include "editor.h"
+
+/* Timing of the hot paths. While perf_on is set, spans around loading,
+ * highlighting, building and writing frames, searching and saving are
+ * recorded: the slowest recent one of each kind shows in the status bar,
+ * and the last PERF_EVENTS can be written out as a Chrome trace for
+ * chrome://tracing or Perfetto. Off, a span costs a test of perf_on. */
+
+#define PERF_EVENTS 65536
+// Where Ctrl-E writes the trace, unless KILO_TRACE names a file; setting
+// KILO_TRACE also turns timing on from the start and writes it on exit
+#define PERF_TRACE_FILE "kilo-trace.json"
+// Spans of each kind the status bar takes the slowest of
+#define PERF_WINDOW 32
+
+enum perf_span {
+  PERF_LOAD,
+  PERF_HIGHLIGHT,
+  PERF_FRAME,
+  PERF_WRITE,
+  PERF_SEARCH,
+  PERF_SNAPSHOT,
+  PERF_SAVE,
+  PERF_SPANS
+};
+
+// Written by the editor thread and read by the workers, so it is only ever
+// touched through PERF_ON() and perf_enable()
+extern int perf_on;
+#define PERF_ON() __atomic_load_n(&perf_on, __ATOMIC_RELAXED)
+
+// A span is timed from PERF_BEGIN() to PERF_END(); one that began while
+// timing was off is dropped
+#define PERF_BEGIN() (PERF_ON() ? perf_now() : 0)
+#define PERF_END(span, start)                                                  \
+  do {                                                                         \
+    if (PERF_ON() && (start) != 0) {                                           \
+      perf_record(span, start);                                                \
+    }                                                                          \
+  } while (0)
+
+double perf_now();
+void perf_record(enum perf_span span, double start);
+void perf_enable(int on);
+int perf_hud(char *buf, int len);
+int perf_export(const char *path);
+const char *perf_trace_path();
+
+#endif
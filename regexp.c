@@ -0,0 +1,738 @@
+#include "regexp.h"
+#include "terminal.h"
+#include <ctype.h>
+
+// Bounds on what a pattern may compile to, so {m,n} cannot exhaust memory
+#define REGEX_MAX_NODES 10000
+#define REGEX_MAX_PROG 20000
+// DFA states kept before the cache is thrown away and rebuilt. The tables
+// start out room for a few and double as states are made, so compiling a
+// query on every key stays cheap.
+#define REGEX_MIN_STATES 16
+#define REGEX_MAX_STATES 2048
+
+enum regex_op { I_SET, I_SPLIT, I_JMP, I_BOL, I_EOL, I_MATCH };
+
+struct regex_inst {
+  unsigned char op;
+  int x, y;
+};
+
+/* Parsing */
+
+enum node_type { N_EMPTY, N_SET, N_CAT, N_ALT, N_REPEAT, N_BOL, N_EOL };
+
+struct node {
+  int type;
+  int a, b; // children
+  int min, max; // repeat bounds, max -1 for none
+  int set;
+};
+
+struct parser {
+  const char *p;
+  struct regex *re;
+  struct node *nodes;
+  int nnodes;
+  int icase;
+  const char *error;
+};
+
+static int new_node(struct parser *ps, int type, int a, int b) {
+  if (ps->nnodes == REGEX_MAX_NODES) {
+    ps->error = "pattern too large";
+    return 0;
+  }
+  struct node *n = &ps->nodes[ps->nnodes];
+  memset(n, 0, sizeof(*n));
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  return ps->nnodes++;
+}
+
+static int new_set(struct parser *ps) {
+  struct regex *re = ps->re;
+  re->sets = realloc(re->sets, sizeof(*re->sets) * (re->nsets + 1));
+  if (re->sets == NULL) {
+    die("realloc");
+  }
+  memset(re->sets[re->nsets], 0, sizeof(*re->sets));
+  return re->nsets++;
+}
+
+static void set_add(struct parser *ps, int set, unsigned char c) {
+  ps->re->sets[set][c >> 3] |= 1 << (c & 7);
+  if (ps->icase && isalpha(c)) {
+    unsigned char other = islower(c) ? toupper(c) : tolower(c);
+    ps->re->sets[set][other >> 3] |= 1 << (other & 7);
+  }
+}
+
+static void set_range(struct parser *ps, int set, int from, int to) {
+  for (int c = from; c <= to; c++) {
+    set_add(ps, set, c);
+  }
+}
+
+/* Adds the class named by the escape \c to set; returns 0 if \c names a
+ * single character instead. */
+static int set_escape(struct parser *ps, int set, char c) {
+  int lower = tolower((unsigned char)c);
+  if (lower != 'd' && lower != 'w' && lower != 's') {
+    return 0;
+  }
+  unsigned char class[32] = {0};
+  for (int b = 0; b < 256; b++) {
+    int in = lower == 'd'   ? isdigit(b)
+             : lower == 'w' ? isalnum(b) || b == '_'
+                            : isspace(b);
+    if (in != (c != lower)) {
+      class[b >> 3] |= 1 << (b & 7);
+    }
+  }
+  for (int i = 0; i < 32; i++) {
+    ps->re->sets[set][i] |= class[i];
+  }
+  return 1;
+}
+
+static char escaped(char c) {
+  switch (c) {
+  case 't': return '\t';
+  case 'r': return '\r';
+  case 'f': return '\f';
+  case 'v': return '\v';
+  default: return c;
+  }
+}
+
+static int parse_class(struct parser *ps) {
+  int set = new_set(ps);
+  int negate = *ps->p == '^';
+  if (negate) {
+    ps->p++;
+  }
+  int first = 1;
+  while (*ps->p && (*ps->p != ']' || first)) {
+    first = 0;
+    unsigned char c = *ps->p++;
+    if (c == '\\') {
+      if (*ps->p == '\0') {
+        break;
+      }
+      if (set_escape(ps, set, *ps->p)) {
+        ps->p++;
+        continue;
+      }
+      c = escaped(*ps->p++);
+    }
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      unsigned char to = ps->p[1];
+      ps->p += 2;
+      if (to == '\\' && *ps->p) {
+        to = escaped(*ps->p++);
+      }
+      if (to < c) {
+        ps->error = "bad range in []";
+        return 0;
+      }
+      set_range(ps, set, c, to);
+    } else {
+      set_add(ps, set, c);
+    }
+  }
+  if (*ps->p != ']') {
+    ps->error = "unterminated [";
+    return 0;
+  }
+  ps->p++;
+  if (negate) {
+    for (int i = 0; i < 32; i++) {
+      ps->re->sets[set][i] ^= 0xff;
+    }
+  }
+  int n = new_node(ps, N_SET, 0, 0);
+  ps->nodes[n].set = set;
+  return n;
+}
+
+static int parse_alt(struct parser *ps);
+
+static int parse_atom(struct parser *ps) {
+  char c = *ps->p++;
+  int n, set;
+  switch (c) {
+  case '(':
+    n = parse_alt(ps);
+    if (*ps->p != ')') {
+      ps->error = "unmatched (";
+      return 0;
+    }
+    ps->p++;
+    return n;
+  case '[':
+    return parse_class(ps);
+  case '^':
+    return new_node(ps, N_BOL, 0, 0);
+  case '$':
+    return new_node(ps, N_EOL, 0, 0);
+  case '*':
+  case '+':
+  case '?':
+  case '{':
+    ps->error = "nothing to repeat";
+    return 0;
+  }
+  set = new_set(ps);
+  if (c == '.') {
+    set_range(ps, set, 0, 255);
+  } else if (c == '\\') {
+    if (*ps->p == '\0') {
+      ps->error = "trailing \\";
+      return 0;
+    }
+    c = *ps->p++;
+    if (!set_escape(ps, set, c)) {
+      set_add(ps, set, escaped(c));
+    }
+  } else {
+    set_add(ps, set, c);
+  }
+  n = new_node(ps, N_SET, 0, 0);
+  ps->nodes[n].set = set;
+  return n;
+}
+
+static int parse_number(struct parser *ps) {
+  if (!isdigit((unsigned char)*ps->p)) {
+    return -1;
+  }
+  int n = 0;
+  while (isdigit((unsigned char)*ps->p) && n < 100000) {
+    n = n * 10 + *ps->p++ - '0';
+  }
+  return n;
+}
+
+static int parse_repeat(struct parser *ps) {
+  int n = parse_atom(ps);
+  while (!ps->error) {
+    int min, max;
+    if (*ps->p == '*') {
+      min = 0, max = -1;
+    } else if (*ps->p == '+') {
+      min = 1, max = -1;
+    } else if (*ps->p == '?') {
+      min = 0, max = 1;
+    } else if (*ps->p == '{') {
+      ps->p++;
+      min = parse_number(ps);
+      max = min;
+      if (*ps->p == ',') {
+        ps->p++;
+        max = parse_number(ps);
+      }
+      if (min < 0 || *ps->p != '}' || (max != -1 && max < min) ||
+          max > 1000) {
+        ps->error = "bad {m,n}";
+        return 0;
+      }
+    } else {
+      break;
+    }
+    ps->p++;
+    n = new_node(ps, N_REPEAT, n, 0);
+    ps->nodes[n].min = min;
+    ps->nodes[n].max = max;
+  }
+  return n;
+}
+
+static int parse_cat(struct parser *ps) {
+  int n = new_node(ps, N_EMPTY, 0, 0);
+  while (!ps->error && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    n = new_node(ps, N_CAT, n, parse_repeat(ps));
+  }
+  return n;
+}
+
+static int parse_alt(struct parser *ps) {
+  int n = parse_cat(ps);
+  while (!ps->error && *ps->p == '|') {
+    ps->p++;
+    n = new_node(ps, N_ALT, n, parse_cat(ps));
+  }
+  return n;
+}
+
+/* Code generation */
+
+static int emit(struct parser *ps, int op) {
+  struct regex *re = ps->re;
+  if (re->len == REGEX_MAX_PROG) {
+    ps->error = "pattern too large";
+    return 0;
+  }
+  re->prog[re->len].op = op;
+  re->prog[re->len].x = re->prog[re->len].y = 0;
+  return re->len++;
+}
+
+static void gen(struct parser *ps, int n) {
+  struct regex *re = ps->re;
+  struct node *node = &ps->nodes[n];
+  int pc, jmp;
+  if (ps->error) {
+    return;
+  }
+  switch (node->type) {
+  case N_SET:
+    pc = emit(ps, I_SET);
+    re->prog[pc].x = node->set;
+    break;
+  case N_CAT:
+    gen(ps, node->a);
+    gen(ps, node->b);
+    break;
+  case N_ALT:
+    pc = emit(ps, I_SPLIT);
+    re->prog[pc].x = re->len;
+    gen(ps, node->a);
+    jmp = emit(ps, I_JMP);
+    re->prog[pc].y = re->len;
+    gen(ps, node->b);
+    re->prog[jmp].x = re->len;
+    break;
+  case N_REPEAT:
+    for (int i = 0; i < node->min; i++) {
+      gen(ps, node->a);
+    }
+    if (node->max == -1) {
+      pc = emit(ps, I_SPLIT);
+      re->prog[pc].x = re->len;
+      gen(ps, node->a);
+      jmp = emit(ps, I_JMP);
+      re->prog[jmp].x = pc;
+      re->prog[pc].y = re->len;
+    }
+    for (int i = node->min; i < node->max; i++) {
+      pc = emit(ps, I_SPLIT);
+      re->prog[pc].x = re->len;
+      gen(ps, node->a);
+      re->prog[pc].y = re->len;
+    }
+    break;
+  case N_BOL:
+    emit(ps, I_BOL);
+    break;
+  case N_EOL:
+    emit(ps, I_EOL);
+    break;
+  }
+}
+
+/* The lazy DFA */
+
+static int closure_gen;
+static int *closure_seen, *closure_stack, closure_size;
+
+/* Adds to list the instructions reachable from pc without reading a byte
+ * that either read one or need the end of the line. */
+static void closure(struct regex *re, int pc, int bol, int *list, int *n) {
+  if (closure_size < re->len + 1) {
+    closure_size = re->len + 1;
+    closure_seen = realloc(closure_seen, sizeof(int) * closure_size);
+    closure_stack = realloc(closure_stack, sizeof(int) * closure_size);
+    if (closure_seen == NULL || closure_stack == NULL) {
+      die("realloc");
+    }
+    memset(closure_seen, 0, sizeof(int) * closure_size);
+  }
+  int top = 0;
+  closure_stack[top++] = pc;
+  while (top > 0) {
+    pc = closure_stack[--top];
+    if (closure_seen[pc] == closure_gen) {
+      continue;
+    }
+    closure_seen[pc] = closure_gen;
+    struct regex_inst *in = &re->prog[pc];
+    switch (in->op) {
+    case I_SPLIT:
+      closure_stack[top++] = in->y;
+      closure_stack[top++] = in->x;
+      break;
+    case I_JMP:
+      closure_stack[top++] = in->x;
+      break;
+    case I_BOL:
+      if (bol) {
+        closure_stack[top++] = pc + 1;
+      }
+      break;
+    default:
+      list[(*n)++] = pc;
+    }
+  }
+}
+
+static int cmp_int(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static unsigned int hash_pcs(int *pcs, int n) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++) {
+    h = (h ^ (unsigned int)pcs[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void dfa_flush(struct regex_dfa *d) {
+  for (int i = 0; i < d->nstates; i++) {
+    free(d->states[i].pcs);
+  }
+  d->nstates = 0;
+  for (int i = 0; i < d->cap * 2; i++) {
+    d->table[i] = -1;
+  }
+  d->start[0] = d->start[1] = -1;
+}
+
+static void dfa_insert(struct regex_dfa *d, int id) {
+  struct regex_state *st = &d->states[id];
+  unsigned int slot = hash_pcs(st->pcs, st->npcs) % (d->cap * 2);
+  while (d->table[slot] != -1) {
+    slot = (slot + 1) % (d->cap * 2);
+  }
+  d->table[slot] = id;
+}
+
+/* Doubles the room for states, keeping the ones made so far. */
+static void dfa_grow(struct regex_dfa *d) {
+  d->cap = d->cap ? d->cap * 2 : REGEX_MIN_STATES;
+  d->states = realloc(d->states, sizeof(struct regex_state) * d->cap);
+  d->trans = realloc(d->trans, sizeof(int) * 256 * d->cap);
+  free(d->table);
+  d->table = malloc(sizeof(int) * d->cap * 2);
+  if (d->states == NULL || d->trans == NULL || d->table == NULL) {
+    die("malloc");
+  }
+  for (int i = 0; i < d->cap * 2; i++) {
+    d->table[i] = -1;
+  }
+  for (int i = 0; i < d->nstates; i++) {
+    dfa_insert(d, i);
+  }
+}
+
+/* The state for a sorted set of instructions, made if it is new. Making one
+ * may flush the cache, which invalidates every other state id. */
+static int dfa_state(struct regex *re, struct regex_dfa *d, int *pcs, int n) {
+  unsigned int slot = hash_pcs(pcs, n) % (d->cap * 2);
+  for (; d->table[slot] != -1; slot = (slot + 1) % (d->cap * 2)) {
+    struct regex_state *st = &d->states[d->table[slot]];
+    if (st->npcs == n && !memcmp(st->pcs, pcs, sizeof(int) * n)) {
+      return d->table[slot];
+    }
+  }
+  if (d->nstates == d->cap) {
+    if (d->cap < REGEX_MAX_STATES) {
+      dfa_grow(d);
+    } else {
+      dfa_flush(d);
+    }
+    return dfa_state(re, d, pcs, n);
+  }
+
+  int id = d->nstates++;
+  struct regex_state *st = &d->states[id];
+  st->pcs = malloc(sizeof(int) * (n ? n : 1));
+  if (st->pcs == NULL) {
+    die("malloc");
+  }
+  memcpy(st->pcs, pcs, sizeof(int) * n);
+  st->npcs = n;
+  st->accept = st->accept_eol = 0;
+  int *eol = malloc(sizeof(int) * (re->len + 1)), neol = 0;
+  if (eol == NULL) {
+    die("malloc");
+  }
+  closure_gen++;
+  for (int i = 0; i < n; i++) {
+    if (re->prog[pcs[i]].op == I_MATCH) {
+      st->accept = 1;
+    } else if (re->prog[pcs[i]].op == I_EOL) {
+      closure(re, pcs[i] + 1, 0, eol, &neol);
+    }
+  }
+  for (int i = 0; i < neol; i++) {
+    st->accept_eol |= re->prog[eol[i]].op == I_MATCH;
+  }
+  st->accept_eol |= st->accept;
+  free(eol);
+  memset(&d->trans[id * 256], 0xff, sizeof(int) * 256);
+  d->table[slot] = id;
+  return id;
+}
+
+static int *scratch;
+
+// Thread lists for finding where the leftmost match starts
+struct threads {
+  int *pcs;
+  ssize_t *starts; // where the thread at each instruction started
+  int n;
+};
+
+static struct threads pike[2];
+static int *pike_seen, *pike_stack, pike_gen;
+
+static int dfa_start(struct regex *re, struct regex_dfa *d, int bol) {
+  if (d->start[bol] == -1) {
+    int n = 0;
+    closure_gen++;
+    closure(re, 0, bol, scratch, &n);
+    qsort(scratch, n, sizeof(int), cmp_int);
+    int id = dfa_state(re, d, scratch, n);
+    d->start[bol] = id;
+  }
+  return d->start[bol];
+}
+
+static int dfa_step(struct regex *re, struct regex_dfa *d, int s,
+                    unsigned char c) {
+  struct regex_state *st = &d->states[s];
+  int n = 0;
+  closure_gen++;
+  for (int i = 0; i < st->npcs; i++) {
+    struct regex_inst *in = &re->prog[st->pcs[i]];
+    if (in->op == I_SET && re->sets[in->x][c >> 3] & (1 << (c & 7))) {
+      closure(re, st->pcs[i] + 1, 0, scratch, &n);
+    }
+  }
+  if (d->unanchored) {
+    closure(re, 0, 0, scratch, &n);
+  }
+  qsort(scratch, n, sizeof(int), cmp_int);
+  int flushes = d->nstates;
+  int id = dfa_state(re, d, scratch, n);
+  if (d->nstates >= flushes) {
+    d->trans[s * 256 + c] = id;
+  }
+  return id;
+}
+
+#define STEP(re, d, s, c)                                                      \
+  ((d)->trans[(s) * 256 + (unsigned char)(c)] != -1                            \
+       ? (d)->trans[(s) * 256 + (unsigned char)(c)]                            \
+       : dfa_step(re, d, s, c))
+
+static void dfa_init(struct regex_dfa *d, int unanchored) {
+  d->unanchored = unanchored;
+  d->states = NULL;
+  d->trans = NULL;
+  d->table = NULL;
+  d->nstates = d->cap = 0;
+  dfa_grow(d);
+  dfa_flush(d);
+}
+
+static void dfa_free(struct regex_dfa *d) {
+  dfa_flush(d);
+  free(d->states);
+  free(d->trans);
+  free(d->table);
+}
+
+struct regex *regex_compile(const char *pattern, int ignore_case,
+                            const char **error) {
+  struct regex *re = calloc(1, sizeof(struct regex));
+  if (re == NULL) {
+    die("calloc");
+  }
+  struct parser ps = {pattern, re, NULL, 0, ignore_case, NULL};
+  ps.nodes = malloc(sizeof(struct node) * REGEX_MAX_NODES);
+  re->prog = malloc(sizeof(struct regex_inst) * REGEX_MAX_PROG);
+  if (ps.nodes == NULL || re->prog == NULL) {
+    die("malloc");
+  }
+  int root = parse_alt(&ps);
+  if (!ps.error && *ps.p == ')') {
+    ps.error = "unmatched )";
+  }
+  gen(&ps, root);
+  emit(&ps, I_MATCH);
+  free(ps.nodes);
+  if (ps.error) {
+    *error = ps.error;
+    free(re->prog);
+    free(re->sets);
+    free(re);
+    return NULL;
+  }
+
+  if (scratch == NULL) {
+    scratch = malloc(sizeof(int) * (REGEX_MAX_PROG + 1));
+    pike_seen = calloc(REGEX_MAX_PROG + 1, sizeof(int));
+    pike_stack = malloc(sizeof(int) * (REGEX_MAX_PROG + 1));
+    for (int i = 0; i < 2; i++) {
+      pike[i].pcs = malloc(sizeof(int) * (REGEX_MAX_PROG + 1));
+      pike[i].starts = malloc(sizeof(ssize_t) * (REGEX_MAX_PROG + 1));
+      if (pike[i].pcs == NULL || pike[i].starts == NULL) {
+        die("malloc");
+      }
+    }
+    if (scratch == NULL || pike_seen == NULL || pike_stack == NULL) {
+      die("malloc");
+    }
+  }
+  dfa_init(&re->search, 1);
+  dfa_init(&re->anchored, 0);
+  int start = dfa_start(re, &re->anchored, 1);
+  re->nullable = re->anchored.states[start].accept_eol;
+  return re;
+}
+
+/* Finding where the leftmost match starts */
+
+/* Adds to t the instructions reachable from pc without reading a byte, for
+ * a thread that started at start. Threads are added in order of where they
+ * started, so the first to reach an instruction keeps the leftmost start. */
+static void pike_add(struct regex *re, struct threads *t, int pc,
+                     ssize_t start, int bol, int eol) {
+  int top = 0;
+  pike_stack[top++] = pc;
+  while (top > 0) {
+    pc = pike_stack[--top];
+    if (pike_seen[pc] == pike_gen) {
+      continue;
+    }
+    pike_seen[pc] = pike_gen;
+    struct regex_inst *in = &re->prog[pc];
+    switch (in->op) {
+    case I_SPLIT:
+      pike_stack[top++] = in->y;
+      pike_stack[top++] = in->x;
+      break;
+    case I_JMP:
+      pike_stack[top++] = in->x;
+      break;
+    case I_BOL:
+    case I_EOL:
+      if (in->op == I_BOL ? bol : eol) {
+        pike_stack[top++] = pc + 1;
+      }
+      break;
+    default:
+      t->pcs[t->n] = pc;
+      t->starts[t->n++] = start;
+    }
+  }
+}
+
+/* The leftmost start in [from, limit) of a non-empty match, or -1. The NFA
+ * runs once over the text with every thread carrying where it started, so
+ * each byte is read once however many starts are still live. */
+static ssize_t leftmost_start(struct regex *re, const char *text, ssize_t len,
+                              ssize_t from, ssize_t limit) {
+  struct threads *cur = &pike[0], *next = &pike[1], *swap;
+  ssize_t best = -1;
+  cur->n = 0;
+  pike_gen++;
+  pike_add(re, cur, 0, from, from == 0, from == len);
+  for (ssize_t i = from;; i++) {
+    // Threads are in order of start, so the first match is the leftmost
+    for (int j = 0; j < cur->n && (best == -1 || cur->starts[j] < best); j++) {
+      if (re->prog[cur->pcs[j]].op == I_MATCH && cur->starts[j] < i) {
+        best = cur->starts[j];
+      }
+    }
+    // Only a thread that started left of the best match can still beat it
+    if (i == len || (best != -1 && (cur->n == 0 || cur->starts[0] >= best))) {
+      return best;
+    }
+
+    next->n = 0;
+    pike_gen++;
+    unsigned char c = text[i];
+    for (int j = 0; j < cur->n && (best == -1 || cur->starts[j] < best); j++) {
+      struct regex_inst *in = &re->prog[cur->pcs[j]];
+      if (in->op == I_SET && re->sets[in->x][c >> 3] & (1 << (c & 7))) {
+        pike_add(re, next, cur->pcs[j] + 1, cur->starts[j], 0, i + 1 == len);
+      }
+    }
+    if (best == -1 && i + 1 < limit) {
+      pike_add(re, next, 0, i + 1, 0, i + 1 == len);
+    }
+    if (next->n == 0 && (best != -1 || i + 1 >= limit)) {
+      return best;
+    }
+    swap = cur;
+    cur = next;
+    next = swap;
+  }
+}
+
+/* Where the longest match starting at start ends, or -1. */
+static ssize_t longest_at(struct regex *re, const char *text, ssize_t len,
+                          ssize_t start) {
+  struct regex_dfa *d = &re->anchored;
+  int s = dfa_start(re, d, start == 0);
+  ssize_t longest = -1, i;
+  for (i = start; i < len; i++) {
+    s = STEP(re, d, s, text[i]);
+    if (d->states[s].npcs == 0) {
+      break;
+    }
+    if (d->states[s].accept) {
+      longest = i + 1;
+    }
+  }
+  if (i == len && d->states[s].accept_eol) {
+    longest = len;
+  }
+  return longest;
+}
+
+/* Finds the leftmost-longest non-empty match in the line text[0, len) that
+ * starts at or after from. Returns its start and sets *mlen, or returns -1.
+ * A DFA pass finds where the earliest match ends, which rejects most lines
+ * and bounds the starts to look at; one NFA pass then finds the leftmost
+ * start and a last DFA pass the longest match from there. */
+ssize_t regex_find(struct regex *re, const char *text, ssize_t len,
+                   ssize_t from, ssize_t *mlen) {
+  ssize_t limit = len;
+  if (!re->nullable) {
+    struct regex_dfa *d = &re->search;
+    int s = dfa_start(re, d, from == 0);
+    ssize_t i = from;
+    while (!d->states[s].accept && i < len) {
+      s = STEP(re, d, s, text[i]);
+      i++;
+    }
+    if (!d->states[s].accept && !d->states[s].accept_eol) {
+      return -1;
+    }
+    limit = i;
+  }
+
+  ssize_t start = leftmost_start(re, text, len, from, limit);
+  if (start == -1) {
+    return -1;
+  }
+  *mlen = longest_at(re, text, len, start) - start;
+  return start;
+}
+
+void regex_free(struct regex *re) {
+  if (re == NULL) {
+    return;
+  }
+  dfa_free(&re->search);
+  dfa_free(&re->anchored);
+  free(re->prog);
+  free(re->sets);
+  free(re);
+}
@@ -0,0 +1,43 @@
+#ifndef REGEXP
+#define REGEXP
+
+#include <sys/types.h>
+
+/* Regular expressions compiled to a Thompson NFA and matched with a DFA that
+ * is built lazily, one state the first time it is reached, and one NFA pass
+ * that tracks where each thread started, so matching time stays linear in
+ * the text. Supported: literals, ., [] classes with ranges and negation,
+ * \d \w \s and their negations, ^ $, * + ? {m,n}, | and ().
+ * Matches are leftmost-longest and never span a line. */
+
+struct regex_state {
+  int *pcs; // the NFA instructions this state stands for
+  int npcs;
+  int accept, accept_eol;
+};
+
+struct regex_dfa {
+  int unanchored; // every position may start a match
+  struct regex_state *states;
+  int *trans; // 256 per state, -1 until computed
+  int nstates, cap;
+  int *table; // hash of pc sets to state ids
+  int start[2];  // start state in the middle, and at the start, of a line
+};
+
+struct regex {
+  struct regex_inst *prog;
+  int len;
+  unsigned char (*sets)[32];
+  int nsets;
+  int nullable;
+  struct regex_dfa search, anchored;
+};
+
+struct regex *regex_compile(const char *pattern, int ignore_case,
+                            const char **error);
+ssize_t regex_find(struct regex *re, const char *text, ssize_t len,
+                   ssize_t from, ssize_t *mlen);
+void regex_free(struct regex *re);
+
+#endif
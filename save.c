@@ -0,0 +1,326 @@
+#include "save.h"
+#include "document.h"
+#include "input.h"
+#include "perf.h"
+#include <pthread.h>
+
+static struct {
+  char *path;
+  char *tmp; // renamed over path when done, NULL when writing in place
+  int fd;
+  struct iovec *iov;
+  int niov, cap;
+  size_t len;
+  char **retired;
+  int nretired, retired_cap;
+  unsigned long version;
+  double start;
+  pthread_t thread;
+  // Shared with the writer
+  pthread_mutex_t lock;
+  size_t written;
+  int done;
+  int err;
+} save = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Appends a slice to the snapshot, extending the last one if p follows it. */
+static void add_slice(const char *p, size_t len) {
+  struct iovec *last = save.niov ? &save.iov[save.niov - 1] : NULL;
+  save.len += len;
+  if (last && (char *)last->iov_base + last->iov_len == p) {
+    last->iov_len += len;
+    return;
+  }
+  if (len == 0) {
+    return;
+  }
+  if (save.niov == save.cap) {
+    save.cap = save.cap ? save.cap * 2 : 1024;
+    save.iov = realloc(save.iov, sizeof(struct iovec) * save.cap);
+    if (save.iov == NULL) {
+      die("realloc");
+    }
+  }
+  save.iov[save.niov].iov_base = (char *)p;
+  save.iov[save.niov].iov_len = len;
+  save.niov++;
+}
+
+static void add_row(erow *row) {
+  static const char newline = '\n';
+  if (row->chars) {
+    row->frozen = E.save_epoch;
+    add_slice(row->chars, row->gap);
+    add_slice(&row->chars[row->gap + GAP_LEN(row)], row->size - row->gap);
+    add_slice(&newline, 1);
+  } else if (row->src + row->size < E.map + E.map_len &&
+             row->src[row->size] == '\n') {
+    add_slice(row->src, row->size + 1);
+  } else {
+    add_slice(row->src, row->size);
+    add_slice(&newline, 1);
+  }
+}
+
+/* Takes the snapshot. Runs of unloaded rows are one slice of the mapping
+ * found without visiting the rows, unless rows were deleted from the middle
+ * of such a run or the file has \r\n line ends, which are not saved. */
+static void take_snapshot() {
+  E.save_epoch++;
+  save.niov = 0;
+  save.len = 0;
+  int contiguous = !E.map_gaps && !E.map_crlf;
+  for (int at = 0; at < E.numrows;) {
+    int stop = row_next_loaded(at);
+    if (contiguous && stop > at) {
+      erow *first = row_at(at), *last = row_at(stop - 1);
+      add_slice(first->src, last->src - first->src);
+      add_row(last);
+      at = stop;
+      continue;
+    }
+    int end = stop < E.numrows ? stop : E.numrows - 1;
+    for (erow *row = row_at(at); at <= end; at++, row = row_next(row)) {
+      add_row(row);
+    }
+  }
+}
+
+static int writev_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t done = writev(fd, iov, n);
+    if (done == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (n > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+/* Syncs the directory holding path, so a rename into it is durable. */
+static void sync_dir(const char *path) {
+  char *dir = strdup(path);
+  char *slash = strrchr(dir, '/');
+  if (slash) {
+    slash[slash == dir] = '\0';
+  }
+  int fd = open(slash ? dir : ".", O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+static void *writer(void *arg) {
+  (void)arg;
+  double t = PERF_BEGIN();
+  int err = 0;
+  for (int i = 0; i < save.niov && !err; i += SAVE_IOVECS) {
+    int n = save.niov - i < SAVE_IOVECS ? save.niov - i : SAVE_IOVECS;
+    size_t bytes = 0;
+    for (int j = i; j < i + n; j++) {
+      bytes += save.iov[j].iov_len;
+    }
+    if (writev_all(save.fd, &save.iov[i], n) == -1) {
+      err = errno;
+    }
+    pthread_mutex_lock(&save.lock);
+    save.written += bytes;
+    pthread_mutex_unlock(&save.lock);
+  }
+  if (!err && save.tmp) {
+    if ((SAVE_FSYNC && fsync(save.fd) == -1) ||
+        rename(save.tmp, save.path) == -1) {
+      err = errno;
+    } else if (SAVE_FSYNC) {
+      sync_dir(save.path);
+    }
+  }
+  if (err && save.tmp) {
+    unlink(save.tmp);
+  }
+  close(save.fd);
+  pthread_mutex_lock(&save.lock);
+  save.err = err;
+  save.done = 1;
+  pthread_mutex_unlock(&save.lock);
+  PERF_END(PERF_SAVE, t);
+  input_wake();
+  return NULL;
+}
+
+/* Gives every row that still points into the mapped file its own copy, for
+ * when that file is about to be overwritten in place. */
+static void load_all_rows() {
+  if (E.map == NULL) {
+    return;
+  }
+  for (erow *row = row_at(0); row; row = row_next(row)) {
+    row_load(row);
+  }
+}
+
+static int open_in_place(int regular) {
+  save.tmp = NULL;
+  if (regular) {
+    load_all_rows();
+  }
+  return open(save.path, O_WRONLY | O_TRUNC);
+}
+
+/* Opens what the snapshot is written to. A symlink is followed, so the file
+ * it points to is replaced and the link stays. Regular files are written to
+ * a temporary file next to them that is then renamed over them, so a crash
+ * leaves either the old or the new contents. Anything else, like a pipe or
+ * a device, is written in place, and so is a file whose directory takes no
+ * new files or whose owner the temporary file cannot be given. */
+static int open_target() {
+  char *real = realpath(save.path, NULL);
+  if (real) {
+    free(save.path);
+    save.path = real;
+  }
+  struct stat st;
+  int exists = stat(save.path, &st) == 0;
+  if (exists && !S_ISREG(st.st_mode)) {
+    return open_in_place(0);
+  }
+  save.tmp = malloc(strlen(save.path) + 8);
+  if (save.tmp == NULL) {
+    return -1; // reported with malloc's errno
+  }
+  sprintf(save.tmp, "%s.XXXXXX", save.path);
+  int fd = mkstemp(save.tmp);
+  if (fd == -1) {
+    free(save.tmp);
+    save.tmp = NULL;
+    return exists ? open_in_place(1) : -1;
+  }
+  struct stat made;
+  if (exists && fstat(fd, &made) == 0 &&
+      (made.st_uid != st.st_uid || made.st_gid != st.st_gid) &&
+      fchown(fd, st.st_uid, st.st_gid) == -1) {
+    close(fd);
+    unlink(save.tmp);
+    free(save.tmp);
+    return open_in_place(1);
+  }
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, exists ? st.st_mode & 07777 : 0666 & ~mask);
+  return fd;
+}
+
+void save_file() {
+  if (E.saving) {
+    set_status_message("Still saving the last version");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = show_prompt("Save as: %s", NULL);
+    if (E.filename == NULL) {
+      set_status_message("Save aborted");
+      return;
+    }
+    select_syntax_highlight();
+  }
+  save.start = now_ms();
+  free(save.path);
+  free(save.tmp);
+  save.path = strdup(E.filename);
+  save.fd = open_target();
+  if (save.fd == -1) {
+    set_status_message("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  double t = PERF_BEGIN();
+  take_snapshot();
+  PERF_END(PERF_SNAPSHOT, t);
+  save.version = E.version;
+  save.written = 0;
+  save.done = 0;
+  E.saving = 1;
+  if (pthread_create(&save.thread, NULL, writer, NULL) != 0) {
+    writer(NULL);
+    save.thread = pthread_self();
+    save_poll();
+  }
+}
+
+void save_retire(char *chars) {
+  if (save.nretired == save.retired_cap) {
+    save.retired_cap = save.retired_cap ? save.retired_cap * 2 : 64;
+    save.retired = realloc(save.retired, sizeof(char *) * save.retired_cap);
+    if (save.retired == NULL) {
+      die("realloc");
+    }
+  }
+  save.retired[save.nretired++] = chars;
+}
+
+/* Percent of the snapshot written so far. */
+int save_progress() {
+  pthread_mutex_lock(&save.lock);
+  size_t written = save.written;
+  pthread_mutex_unlock(&save.lock);
+  return save.len ? written * 100 / save.len : 100;
+}
+
+/* Finishes a save once the writer is done; returns whether the status
+ * shown for the save changed since the last call. */
+int save_poll() {
+  static int shown = -1;
+  if (!E.saving) {
+    return 0;
+  }
+  pthread_mutex_lock(&save.lock);
+  int done = save.done;
+  pthread_mutex_unlock(&save.lock);
+  if (!done) {
+    int progress = save_progress();
+    int changed = progress != shown;
+    shown = progress;
+    return changed;
+  }
+
+  if (!pthread_equal(save.thread, pthread_self())) {
+    pthread_join(save.thread, NULL);
+  }
+  for (int i = 0; i < save.nretired; i++) {
+    free(save.retired[i]);
+  }
+  save.nretired = 0;
+  E.saving = 0;
+  shown = -1;
+  if (save.err) {
+    set_status_message("Can't save! I/O error: %s", strerror(save.err));
+    return 1;
+  }
+  // Edits made while the writer ran are not in the file
+  E.saved_version = save.version;
+  double ms = now_ms() - save.start;
+  set_status_message("Wrote %zu bytes in %.0f ms (%.1f MB/s)", save.len, ms,
+                     ms > 0 ? save.len / ms / 1e3 : 0.0);
+  return 1;
+}
+
+void save_wait() {
+  if (E.saving) {
+    pthread_join(save.thread, NULL);
+    save.thread = pthread_self();
+    save_poll();
+  }
+}
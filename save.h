@@ -0,0 +1,17 @@
+#ifndef SAVE
+#define SAVE
+
+#include "editor.h"
+
+/* Saving takes a snapshot of the document as a list of slices of row
+ * storage and hands it to a writer thread. Loaded rows in the snapshot are
+ * frozen: before one is changed it gets a fresh copy of its chars, and the
+ * frozen buffer is retired until the writer is done with it. */
+
+void save_file();
+int save_poll();
+void save_wait();
+int save_progress();
+void save_retire(char *chars);
+
+#endif
@@ -0,0 +1,184 @@
+#include "screen.h"
+#include "terminal.h"
+#include "utf8.h"
+
+static const struct cell blank = {" ", 1, COLOR_DEFAULT};
+
+static int same_cell(const struct cell *a, const struct cell *b) {
+  return a->ch[0] == b->ch[0] && a->len == b->len && a->color == b->color &&
+         (a->len == 1 || memcmp(a->ch, b->ch, a->len) == 0);
+}
+
+void screen_resize(struct screen *s, int rows, int cols) {
+  free(s->cells);
+  free(s->shadow);
+  s->cells = malloc(sizeof(struct cell) * rows * cols);
+  s->shadow = malloc(sizeof(struct cell) * rows * cols);
+  if (s->cells == NULL || s->shadow == NULL) {
+    die("malloc");
+  }
+  s->rows = rows;
+  s->cols = cols;
+  s->valid = 0;
+  for (int y = 0; y < rows; y++) {
+    screen_fill(s, y, 0, COLOR_DEFAULT);
+  }
+}
+
+/* Blanks row y from column x to the end. */
+void screen_fill(struct screen *s, int y, int x, unsigned char color) {
+  struct cell *row = &s->cells[y * s->cols];
+  if (x > 0 && x < s->cols && row[x].len == 0) {
+    row[x - 1] = blank;
+  }
+  for (; x < s->cols; x++) {
+    row[x].ch[0] = ' ';
+    row[x].len = 1;
+    row[x].color = color;
+  }
+}
+
+/* Puts the character g[0..len), which takes width columns, at column x of
+ * row y and returns the column after it. A zero-width character joins the
+ * one before it while there is room, and a wide one that does not fit on
+ * the row is left blank. */
+int screen_glyph(struct screen *s, int y, int x, const char *g, int len,
+                 int width, unsigned char color) {
+  struct cell *row = &s->cells[y * s->cols];
+  if (width == 0) {
+    int last = x - 1;
+    while (last > 0 && row[last].len == 0) last--;
+    if (last >= 0 && row[last].len + len <= CELL_BYTES) {
+      memcpy(&row[last].ch[row[last].len], g, len);
+      row[last].len += len;
+    }
+    return x;
+  }
+  if (x >= s->cols) {
+    return x;
+  }
+  if (x + width > s->cols) {
+    g = " ";
+    len = width = 1;
+  }
+  // Writing over half of a wide character blanks the other half
+  if (x > 0 && row[x].len == 0) {
+    row[x - 1] = blank;
+  }
+  if (x + width < s->cols && row[x + width].len == 0) {
+    row[x + width] = blank;
+  }
+  memcpy(row[x].ch, g, len);
+  row[x].len = len;
+  row[x].color = color;
+  for (int i = 1; i < width; i++) {
+    row[x + i].len = 0;
+    row[x + i].color = color;
+  }
+  return x + width;
+}
+
+/* Puts text at column x of row y. Bytes that are not UTF-8 and control
+ * characters show as '?'. */
+void screen_put(struct screen *s, int y, int x, const char *text, int len,
+                unsigned char color) {
+  for (int i = 0; i < len && x < s->cols;) {
+    int cp, n = utf8_decode(&text[i], len - i, &cp);
+    if (n == 0 || cp < 32 || (cp >= 127 && cp < 160)) {
+      x = screen_glyph(s, y, x, "?", 1, 1, color);
+      i += n ? n : 1;
+    } else {
+      x = screen_glyph(s, y, x, &text[i], n, utf8_width(cp), color);
+      i += n;
+    }
+  }
+}
+
+static void set_color(struct abuf *ab, int *current, int color) {
+  if (*current == color) {
+    return;
+  }
+  char buf[16];
+  int len = color == COLOR_DEFAULT
+                ? snprintf(buf, sizeof(buf), "\x1b[m")
+                : snprintf(buf, sizeof(buf), "\x1b[0;%dm", color);
+  ab_append(ab, buf, len);
+  *current = color;
+}
+
+static void move_to(struct abuf *ab, int y, int x) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  ab_append(ab, buf, len);
+}
+
+/* Appends what it takes to turn the terminal's screen into the composed
+ * frame, wrapped in a synchronized update, and leaves the cursor at (cy, cx). */
+void screen_flush(struct screen *s, struct abuf *ab, int cy, int cx) {
+  int color = -1;
+  int hidden = 0;
+  ab_append(ab, "\x1b[?2026h", 8);
+  if (!s->valid) {
+    ab_append(ab, "\x1b[?25l\x1b[m\x1b[2J", 13);
+    hidden = 1;
+    color = COLOR_DEFAULT;
+    for (int i = 0; i < s->rows * s->cols; i++) {
+      s->shadow[i] = blank;
+    }
+  }
+
+  for (int y = 0; y < s->rows; y++) {
+    struct cell *row = &s->cells[y * s->cols];
+    struct cell *old = &s->shadow[y * s->cols];
+    int first = 0, last = s->cols - 1;
+    while (first < s->cols && same_cell(&row[first], &old[first])) first++;
+    if (first == s->cols) {
+      continue;
+    }
+    while (same_cell(&row[last], &old[last])) last--;
+    int end = s->cols;
+    while (end > 0 && same_cell(&row[end - 1], &blank)) end--;
+    // Wide characters are redrawn whole
+    if (first > 0 && row[first].len == 0) {
+      first--;
+    }
+    if (last + 1 < s->cols && row[last + 1].len == 0) {
+      last++;
+    }
+
+    if (!hidden) {
+      ab_append(ab, "\x1b[?25l", 6);
+      hidden = 1;
+    }
+    move_to(ab, y, first);
+    int stop = last < end ? last + 1 : end;
+    for (int x = first; x < stop;) {
+      int run = x + 1;
+      while (run < stop && row[run].color == row[x].color) run++;
+      set_color(ab, &color, row[x].color);
+      int bytes = 0;
+      for (int i = x; i < run; i++) {
+        bytes += row[i].len;
+      }
+      char *out = ab_extend(ab, bytes);
+      for (; out && x < run; x++) {
+        memcpy(out, row[x].ch, row[x].len);
+        out += row[x].len;
+      }
+      x = run;
+    }
+    if (last >= end) {
+      set_color(ab, &color, COLOR_DEFAULT);
+      ab_append(ab, "\x1b[K", 3);
+    }
+  }
+  memcpy(s->shadow, s->cells, sizeof(struct cell) * s->rows * s->cols);
+  s->valid = 1;
+
+  set_color(ab, &color, COLOR_DEFAULT);
+  move_to(ab, cy, cx);
+  if (hidden) {
+    ab_append(ab, "\x1b[?25h", 6);
+  }
+  ab_append(ab, "\x1b[?2026l", 8);
+}
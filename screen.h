@@ -0,0 +1,38 @@
+#ifndef SCREEN
+#define SCREEN
+
+#include "append_buf.h"
+
+/* Frames are composed into a grid of cells and diffed against a shadow copy
+ * of what the terminal already shows, so only cells that changed are sent. */
+
+#define COLOR_DEFAULT 0
+#define COLOR_INVERSE 7
+
+// Room for a character and the zero-width marks drawn over it
+#define CELL_BYTES 8
+
+/* A cell holds the UTF-8 bytes of what is drawn in it. The column right of
+ * a wide character holds none. */
+struct cell {
+  char ch[CELL_BYTES];
+  unsigned char len;
+  unsigned char color;
+};
+
+struct screen {
+  struct cell *cells;
+  struct cell *shadow;
+  int rows, cols;
+  int valid;
+};
+
+void screen_resize(struct screen *s, int rows, int cols);
+void screen_fill(struct screen *s, int y, int x, unsigned char color);
+void screen_put(struct screen *s, int y, int x, const char *text, int len,
+                unsigned char color);
+int screen_glyph(struct screen *s, int y, int x, const char *g, int len,
+                 int width, unsigned char color);
+void screen_flush(struct screen *s, struct abuf *ab, int cy, int cx);
+
+#endif
@@ -0,0 +1,420 @@
+#include "search.h"
+#include "document.h"
+#include "input.h"
+#include "load.h"
+#include "perf.h"
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Queries at least this long are searched with Horspool's skip table when
+// even their rarest byte is a common one
+#define SEARCH_SKIP_LEN 16
+// Rows scanned, or old matches re-checked, by one step of the worker, and
+// the bytes a step scans before it stops at the end of a row
+#define SEARCH_CHUNK_ROWS 16384
+#define SEARCH_CHUNK_BYTES (4 << 20)
+
+static unsigned char fold(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+/* How common a byte is in source code and prose, higher meaning more. */
+static int frequency(unsigned char c) {
+  static const char common[] = " etaoinsrlcdhupmfgbywvkxjqz_";
+  const char *at = c ? strchr(common, fold(c)) : NULL;
+  return at ? (int)sizeof(common) - (at - common) : 0;
+}
+
+static int is_word(unsigned char c) { return isalnum(c) || c == '_'; }
+
+static int same(struct search *s, const char *p) {
+  if (!(s->flags & SEARCH_IGNORE_CASE)) {
+    return !memcmp(p, s->query, s->qlen);
+  }
+  for (int i = 0; i < s->qlen; i++) {
+    if (fold(p[i]) != fold(s->query[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Whether the query occurs at p, where text spans [start, end). */
+static int match_here(struct search *s, const char *start, const char *end,
+                      const char *p) {
+  if (end - p < s->qlen || !same(s, p)) {
+    return 0;
+  }
+  if (s->flags & SEARCH_WHOLE_WORD) {
+    if (p > start && is_word(p[-1])) return 0;
+    if (p + s->qlen < end && is_word(p[s->qlen])) return 0;
+  }
+  return 1;
+}
+
+/* First byte in [p, end) equal to a or b. */
+static const char *find_byte(const char *p, const char *end, unsigned char a,
+                             unsigned char b) {
+  if (a == b) {
+    return memchr(p, a, end - p);
+  }
+#ifdef __SSE2__
+  __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; p < end; p++) {
+    if ((unsigned char)*p == a || (unsigned char)*p == b) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/* Next occurrence of the query in [p, end), ignoring word boundaries. */
+static const char *scan(struct search *s, const char *p, const char *end) {
+  int n = s->qlen;
+  if (s->horspool) {
+    unsigned char last = fold(s->query[n - 1]);
+    for (; end - p >= n; p += s->skip[(unsigned char)p[n - 1]]) {
+      if (fold(p[n - 1]) == last && same(s, p)) {
+        return p;
+      }
+    }
+    return NULL;
+  }
+  int r = s->rare;
+  unsigned char a = s->query[r], b = a;
+  if (s->flags & SEARCH_IGNORE_CASE && isalpha(a)) {
+    a = tolower(a);
+    b = toupper(a);
+  }
+  while (end - p >= n && (p = find_byte(p + r, end - n + 1 + r, a, b))) {
+    p -= r;
+    if (same(s, p)) {
+      return p;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+static void add_match(struct search *s, int row, ssize_t col, ssize_t len) {
+  if (s->nmatches == SEARCH_MAX_MATCHES) {
+    s->capped = 1;
+    return;
+  }
+  if (s->nmatches == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 256;
+    s->matches = realloc(s->matches, sizeof(struct search_match) * s->cap);
+    if (s->matches == NULL) {
+      die("realloc");
+    }
+  }
+  s->matches[s->nmatches].row = row;
+  s->matches[s->nmatches].col = col;
+  s->matches[s->nmatches].len = len;
+  s->nmatches++;
+}
+
+static int word_bounded(const char *text, ssize_t len, ssize_t at,
+                        ssize_t mlen) {
+  return (at == 0 || !is_word(text[at - 1])) &&
+         (at + mlen == len || !is_word(text[at + mlen]));
+}
+
+/* Adds the matches in one row's text. */
+static void scan_row(struct search *s, int at, const char *text,
+                     ssize_t len) {
+  if (s->re) {
+    ssize_t from = 0, mlen;
+    while ((from = regex_find(s->re, text, len, from, &mlen)) != -1) {
+      if (!(s->flags & SEARCH_WHOLE_WORD) ||
+          word_bounded(text, len, from, mlen)) {
+        add_match(s, at, from, mlen);
+        from += mlen;
+      } else {
+        from++;
+      }
+    }
+    return;
+  }
+  const char *end = text + len;
+  for (const char *p = text; (p = scan(s, p, end)); p++) {
+    if (match_here(s, text, end, p)) {
+      add_match(s, at, p - text, s->qlen);
+    }
+  }
+}
+
+/* End of the line [line, line_end) without its \r line end, trimmed the
+ * same way loading trims rows. The last row of a span already ends before
+ * its \r. */
+static const char *trim_cr(const char *line, const char *line_end) {
+  while (line_end > line && line_end[-1] == '\r') {
+    line_end--;
+  }
+  return line_end;
+}
+
+/* Adds the matches in rows [at, stop), none of which is loaded, scanning
+ * the mapping they point into as one span. */
+static void scan_mapped(struct search *s, int at, int stop) {
+  erow *first = row_at(at), *last = row_at(stop - 1);
+  const char *start = first->src, *end = last->src + last->size;
+  // Rows deleted from the middle leave lines in the mapping that are no
+  // longer in the document; once that has happened, runs that skip lines
+  // are scanned row by row
+  if (E.map_gaps &&
+      (end < start || count_newlines(start, end) != (size_t)(stop - 1 - at))) {
+    for (erow *row = first; at < stop; at++, row = row_next(row)) {
+      scan_row(s, at, row->src, row->size);
+    }
+    return;
+  }
+
+  const char *line = start, *line_end = NULL, *nl;
+  if (s->re) {
+    for (; line <= end; line = line_end + 1, at++) {
+      line_end = memchr(line, '\n', end - line);
+      line_end = line_end ? line_end : end;
+      scan_row(s, at, line, trim_cr(line, line_end) - line);
+    }
+    return;
+  }
+  for (const char *p = start; (p = scan(s, p, end)); p++) {
+    // Matches never cross a line terminator, so the line holding p holds
+    // the whole match
+    while ((nl = memchr(line, '\n', p - line))) {
+      line = nl + 1;
+      line_end = NULL;
+      at++;
+    }
+    if (line_end == NULL) {
+      line_end = memchr(p, '\n', end - p);
+      line_end = trim_cr(line, line_end ? line_end : end);
+    }
+    if (match_here(s, line, line_end, p)) {
+      add_match(s, at, p - line, s->qlen);
+    }
+  }
+}
+
+/* Bytes of the mapping spanned by rows [at, stop), none of which is loaded. */
+static ssize_t mapped_bytes(int at, int stop) {
+  erow *last = row_at(stop - 1);
+  return last->src + last->size - row_at(at)->src;
+}
+
+/* Scans up to SEARCH_CHUNK_ROWS rows, or about SEARCH_CHUNK_BYTES, from where
+ * the last step stopped. */
+static void scan_chunk(struct search *s) {
+  int at = s->next_row;
+  int limit = at + SEARCH_CHUNK_ROWS < E.numrows ? at + SEARCH_CHUNK_ROWS
+                                                 : E.numrows;
+  ssize_t budget = SEARCH_CHUNK_BYTES;
+  while (at < limit && budget > 0 && !s->capped) {
+    int stop = row_next_loaded(at);
+    if (stop > limit) {
+      stop = limit;
+    }
+    if (stop > at) {
+      while (stop - at > 1 && mapped_bytes(at, stop) > budget) {
+        stop = at + (stop - at) / 2;
+      }
+      ssize_t bytes = mapped_bytes(at, stop);
+      budget -= bytes > 0 ? bytes : 0;
+      scan_mapped(s, at, stop);
+      at = stop;
+    } else {
+      erow *row = row_at(at);
+      budget -= row->size;
+      scan_row(s, at, row_chars(row), row->size);
+      at++;
+    }
+  }
+  s->next_row = s->capped ? E.numrows : at;
+}
+
+/* Re-checks the next SEARCH_CHUNK_ROWS of the previous query's matches,
+ * keeping those that still match. */
+static void refine_chunk(struct search *s) {
+  int end = s->checked + SEARCH_CHUNK_ROWS < s->nold
+                ? s->checked + SEARCH_CHUNK_ROWS
+                : s->nold;
+  erow *row = NULL;
+  int at = 0;
+  for (; s->checked < end; s->checked++) {
+    struct search_match m = s->matches[s->checked];
+    if (row == NULL || m.row - at > 64) {
+      row = row_at(m.row);
+      at = m.row;
+    }
+    for (; at < m.row; at++) {
+      row = row_next(row);
+    }
+    const char *text = row->chars ? row_chars(row) : row->src;
+    if (match_here(s, text, text + row->size, text + m.col)) {
+      m.len = s->qlen;
+      s->matches[s->nmatches++] = m;
+    }
+  }
+}
+
+/* Does one bounded piece of the search; returns 0 once it is finished. */
+static int search_step(struct search *s) {
+  if (s->checked < s->nold) {
+    refine_chunk(s);
+  } else if (s->next_row < E.numrows) {
+    scan_chunk(s);
+  } else {
+    s->done = 1;
+  }
+  return !s->done;
+}
+
+/* The worker only runs while the editor waits for input; search_pause()
+ * waits for the step in progress, so the editor never waits longer than one
+ * chunk and the two never touch the document at the same time. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct search *job;
+static int paused = 1, busy, started;
+
+static void *worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (paused || job == NULL || job->done) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    busy = 1;
+    pthread_mutex_unlock(&lock);
+    double t = PERF_BEGIN();
+    int more = search_step(job);
+    PERF_END(PERF_SEARCH, t);
+    if (!more) {
+      input_wake(); // the editor shows the result now, not at its next poll
+    }
+    pthread_mutex_lock(&lock);
+    busy = 0;
+    pthread_cond_broadcast(&cond);
+  }
+  return NULL;
+}
+
+void search_pause() {
+  pthread_mutex_lock(&lock);
+  paused = 1;
+  while (busy) {
+    pthread_cond_wait(&cond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void search_resume() {
+  pthread_mutex_lock(&lock);
+  paused = 0;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Sets up a search for query, dropping the one in progress. Must be called
+ * while the worker is paused; the matches then arrive as it runs. */
+void search_start(struct search *s, const char *query, int flags) {
+  int qlen = strlen(query);
+  // A longer query can only match where the shorter one did, except that a
+  // whole word may stop being one and a pattern may mean something else
+  int grew = s->qlen > 0 && !s->capped && flags == s->flags &&
+             !(flags & (SEARCH_WHOLE_WORD | SEARCH_REGEX)) &&
+             qlen >= s->qlen && !strncmp(query, s->query, s->qlen);
+  free(s->query);
+  s->query = strdup(query);
+  s->qlen = qlen;
+  s->flags = flags;
+  for (int c = 0; c < 256; c++) {
+    s->skip[c] = qlen;
+  }
+  for (int i = 0; i < qlen - 1; i++) {
+    unsigned char c = query[i];
+    s->skip[c] = qlen - 1 - i;
+    if (flags & SEARCH_IGNORE_CASE && isalpha(c)) {
+      s->skip[tolower(c)] = s->skip[toupper(c)] = qlen - 1 - i;
+    }
+  }
+
+  // Candidates are found by the query's rarest byte
+  s->rare = 0;
+  for (int i = 1; i < qlen; i++) {
+    if (frequency(query[i]) < frequency(query[s->rare])) {
+      s->rare = i;
+    }
+  }
+  s->horspool = qlen >= SEARCH_SKIP_LEN && frequency(query[s->rare]) > 0;
+  regex_free(s->re);
+  s->re = NULL;
+  s->error = NULL;
+  if (flags & SEARCH_REGEX && qlen > 0) {
+    s->re = regex_compile(query, flags & SEARCH_IGNORE_CASE, &s->error);
+  }
+
+  // The rows scanned so far only need their matches re-checked; the scan
+  // carries on from where it got to
+  if (grew) {
+    int unchecked = s->nold - s->checked;
+    memmove(&s->matches[s->nmatches], &s->matches[s->checked],
+            sizeof(struct search_match) * unchecked);
+    s->nold = s->nmatches + unchecked;
+    for (int i = 0; i < s->nold; i++) {
+      s->matches[i].len = qlen;
+    }
+  } else {
+    s->nold = 0;
+    s->next_row = 0;
+  }
+  s->checked = 0;
+  s->nmatches = 0;
+  s->capped = 0;
+  s->done = qlen == 0 || s->error;
+  s->seen = -1;
+
+  if (!started) {
+    pthread_t thread;
+    started = pthread_create(&thread, NULL, worker, NULL) == 0;
+  }
+  if (!started) {
+    while (search_step(s)) {}
+  }
+  job = s;
+}
+
+/* Runs a search to the end on the calling thread. */
+void search_run(struct search *s, const char *query, int flags) {
+  search_start(s, query, flags);
+  while (search_step(s)) {}
+}
+
+/* Whether matches arrived or the search finished since the last call. */
+int search_poll(struct search *s) {
+  int changed = s->nmatches + s->done != s->seen;
+  s->seen = s->nmatches + s->done;
+  return changed;
+}
+
+void search_reset(struct search *s) {
+  if (job == s) {
+    job = NULL;
+  }
+  free(s->query);
+  free(s->matches);
+  regex_free(s->re);
+  memset(s, 0, sizeof(*s));
+}
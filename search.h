@@ -0,0 +1,50 @@
+#ifndef SEARCH
+#define SEARCH
+
+#include "editor.h"
+#include "regexp.h"
+
+/* Finds every occurrence of a query in the document on a worker thread, in
+ * row order. Runs of rows that still point into the mapped file are scanned
+ * as one span without visiting the rows, and a query that only grew is
+ * answered by re-checking the previous matches. */
+
+#define SEARCH_IGNORE_CASE 1
+#define SEARCH_WHOLE_WORD 2
+#define SEARCH_REGEX 4
+
+// Matches past this many are dropped and the search stops
+#define SEARCH_MAX_MATCHES (1 << 20)
+
+struct search_match {
+  int row;
+  ssize_t col;
+  ssize_t len;
+};
+
+struct search {
+  char *query;
+  int qlen;
+  int flags;
+  int rare;
+  int horspool;
+  struct regex *re;    // the compiled query in regex mode
+  const char *error;   // why the query did not compile
+  int skip[256];
+  struct search_match *matches; // sorted by row, then column
+  int nmatches, cap;
+  int capped;
+  int nold, checked; // previous matches, and how many were re-checked
+  int next_row;      // where the scan goes on
+  int done;
+  int seen;
+};
+
+void search_start(struct search *s, const char *query, int flags);
+void search_run(struct search *s, const char *query, int flags);
+int search_poll(struct search *s);
+void search_pause();
+void search_resume();
+void search_reset(struct search *s);
+
+#endif
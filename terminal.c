@@ -1,21 +1,104 @@
 #include "terminal.h"
 
+static struct {
+  int on;
+  int rows, cols;
+  void (*idle)();
+  struct abuf keys; // fed and not read yet from start on
+  size_t start;
+  long long written;
+} headless;
+
+void term_headless(int rows, int cols, void (*idle)()) {
+  headless.on = 1;
+  headless.rows = rows;
+  headless.cols = cols;
+  headless.idle = idle;
+}
+
+void term_feed(const char *keys, size_t len) {
+  if (headless.start == headless.keys.len) {
+    ab_reset(&headless.keys);
+    headless.start = 0;
+  }
+  ab_append(&headless.keys, keys, len);
+}
+
+/* Bytes drawn to the headless terminal so far. */
+long long term_written() { return headless.written; }
+
+/* The fd keys are read from, or -1 for the headless terminal, which poll()
+ * then skips. */
+int term_fd() { return headless.on ? -1 : STDIN_FILENO; }
+
+size_t term_queued() { return headless.keys.len - headless.start; }
+
+void term_idle() {
+  if (headless.on && term_queued() == 0) {
+    headless.idle();
+  }
+}
+
+ssize_t term_read(void *buf, size_t len) {
+  if (!headless.on) {
+    return read(STDIN_FILENO, buf, len);
+  }
+  size_t n = term_queued() < len ? term_queued() : len;
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  memcpy(buf, &headless.keys.b[headless.start], n);
+  headless.start += n;
+  return n;
+}
+
+ssize_t term_write(const char *s, size_t len) {
+  if (headless.on) {
+    headless.written += len;
+    return len;
+  }
+  return write(STDOUT_FILENO, s, len);
+}
+
+/* Writes the whole buffer to the terminal. */
+int term_flush(struct abuf *ab) {
+  if (headless.on) {
+    headless.written += ab->len;
+    return 0;
+  }
+  return ab_write(ab, STDOUT_FILENO);
+}
+
+/* Milliseconds on the monotonic clock. */
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
 void clear_screen() {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  term_write("\x1b[2J", 4);
+  term_write("\x1b[H", 3);
 }
 
+/* Reports s and the error and exits, the terminal being restored on exit.
+ * Fatal errors come from any thread and from the middle of tree operations
+ * or a save, so the document is left as it is. */
 int die(const char *s) {
+  int err = errno;
   clear_screen();
+  errno = err;
   perror(s);
-  for (int i = 0; i < E.numrows; ++i) {
-    free(E.row[i].chars);
-  }
-  free(E.row);
   exit(1);
 }
 
 int get_window_size(int *rows, int *cols) {
+  if (headless.on) {
+    *rows = headless.rows;
+    *cols = headless.cols;
+    return 0;
+  }
   struct winsize wsz;
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &wsz) == -1 && wsz.ws_col == 0) {
     return -1;
@@ -27,12 +110,16 @@ int get_window_size(int *rows, int *cols) {
 }
 
 void disable_raw_mode() {
+  term_write("\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termois) == -1) {
     die("tcsetattr");
   }
 }
 
 void enable_raw_mode() {
+  if (headless.on) {
+    return;
+  }
   if (tcgetattr(STDIN_FILENO, &E.orig_termois) == -1) {
     die("tcgetattr");
   }
@@ -43,8 +130,10 @@ void enable_raw_mode() {
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
     die("tcsetattr");
   }
+  // Have pastes arrive wrapped in markers
+  term_write("\x1b[?2004h", 8);
 }
@@ -9,10 +9,26 @@
 #include <termios.h>
 #include <unistd.h>
 
+/* The editor talks to the terminal on stdin and stdout, unless it was made
+ * headless: then keys are fed to it in memory and what it draws is only
+ * counted, so a program can drive and time the editor without a tty. When
+ * the editor has nothing left to do but wait for a key, the headless
+ * terminal calls idle, which feeds more keys or exits. */
+
 void clear_screen();
 int die(const char *s);
+double now_ms();
 int get_window_size(int *rows, int *cols);
 void disable_raw_mode();
 void enable_raw_mode();
+void term_headless(int rows, int cols, void (*idle)());
+void term_feed(const char *keys, size_t len);
+long long term_written();
+int term_fd();
+size_t term_queued();
+void term_idle();
+ssize_t term_read(void *buf, size_t len);
+ssize_t term_write(const char *s, size_t len);
+int term_flush(struct abuf *ab);
 
 #endif
@@ -0,0 +1,332 @@
+#include "undo.h"
+#include "document.h"
+
+enum { OP_INSERT_TEXT, OP_DELETE_TEXT, OP_INSERT_ROWS, OP_DELETE_ROWS };
+
+/* The text of row ops is the rows' chars, each followed by a newline. */
+struct undo_op {
+  unsigned long group;
+  size_t size; // of the whole record, text included
+  size_t prev; // size of the record before this one
+  size_t len;
+  ssize_t col;
+  int type;
+  int row;
+  int nrows;
+};
+
+#define OP_TEXT(op) ((char *)((op) + 1))
+#define OP_SIZE(len) ((sizeof(struct undo_op) + (len) + 7) & ~(size_t)7)
+
+static struct {
+  char *buf;
+  size_t cap;
+  size_t head; // the oldest record
+  size_t cur;  // ops before this can be undone, the ones after redone
+  size_t end;
+  size_t last; // the record that ends at cur
+  unsigned long group;
+  int group_ops;
+  int fresh; // no op has been logged for the key being handled yet
+  int replaying;
+  double logged; // when the last op was logged or extended
+} hist;
+
+static struct undo_op *op_at(size_t off) {
+  return (struct undo_op *)(hist.buf + off);
+}
+
+static void drop_oldest() {
+  unsigned long group = op_at(hist.head)->group;
+  while (hist.head < hist.end && op_at(hist.head)->group == group) {
+    hist.head += op_at(hist.head)->size;
+  }
+}
+
+/* Drops the oldest groups until history and len more bytes fit, keeping the
+ * newest one however large it is. */
+static void trim(size_t len) {
+  while (hist.head < hist.end && hist.end - hist.head + len > UNDO_MAX_BYTES &&
+         op_at(hist.head)->group != hist.group) {
+    drop_oldest();
+  }
+}
+
+/* Moves history to the front of the arena and sizes the arena to it and len
+ * more bytes, no larger than the cap unless history alone is. */
+static void compact(size_t len) {
+  if (hist.head > 0) {
+    memmove(hist.buf, hist.buf + hist.head, hist.end - hist.head);
+    hist.cur -= hist.head;
+    hist.end -= hist.head;
+    hist.last -= hist.head;
+    hist.head = 0;
+  }
+  size_t need = hist.end + len, cap = 4096;
+  while (cap < need) {
+    cap *= 2;
+  }
+  if (cap > UNDO_MAX_BYTES && need <= UNDO_MAX_BYTES) {
+    cap = UNDO_MAX_BYTES;
+  }
+  if (cap != hist.cap) {
+    hist.buf = realloc(hist.buf, cap);
+    if (hist.buf == NULL) {
+      die("realloc");
+    }
+    hist.cap = cap;
+  }
+}
+
+/* Makes room for len more bytes at the end, dropping old history before the
+ * arena grows. */
+static void reserve(size_t len) {
+  if (hist.end + len > hist.cap) {
+    trim(len);
+    compact(len);
+  }
+}
+
+/* Trims history to the cap after an edit was logged, and gives back the room
+ * a group larger than the cap took once that group is dropped. */
+static void fit() {
+  trim(0);
+  if (hist.cap > UNDO_MAX_BYTES && hist.end - hist.head <= UNDO_MAX_BYTES) {
+    compact(0);
+  }
+}
+
+static struct undo_op *add_op(int type, int row, ssize_t col, size_t len) {
+  hist.end = hist.cur; // a new edit ends what could be redone
+  size_t size = OP_SIZE(len);
+  reserve(size);
+  if (hist.fresh) {
+    hist.group++;
+    hist.group_ops = 0;
+    hist.fresh = 0;
+  }
+  struct undo_op *op = op_at(hist.cur);
+  op->group = hist.group;
+  op->size = size;
+  op->prev = hist.cur > hist.head ? op_at(hist.last)->size : 0;
+  op->len = len;
+  op->type = type;
+  op->row = row;
+  op->col = col;
+  op->nrows = 0;
+  hist.last = hist.cur;
+  hist.cur = hist.end = hist.cur + size;
+  hist.group_ops++;
+  hist.logged = now_ms();
+  return op;
+}
+
+/* Returns the newest op if an edit of this type may be folded into it. An
+ * op from an earlier key only takes single characters, and not after a pause,
+ * so typing coalesces while compound edits like joining rows stay apart. */
+static struct undo_op *mergeable(int type, ssize_t len) {
+  if (hist.cur == hist.head) {
+    return NULL;
+  }
+  struct undo_op *op = op_at(hist.last);
+  if (op->type != type || op->group != hist.group) {
+    return NULL;
+  }
+  if (hist.fresh && (hist.group_ops > 1 || len != 1 || type >= OP_INSERT_ROWS ||
+                     now_ms() - hist.logged > UNDO_PAUSE_MS)) {
+    return NULL;
+  }
+  return op;
+}
+
+/* Whether a key's character c, next to the character beside it in the op it
+ * would join, ends a word: typed or deleted text is then undone a word at a
+ * time along with the space after or before it. */
+static int ends_word(char c, char beside) {
+  return hist.fresh && isspace((unsigned char)c) &&
+         !isspace((unsigned char)beside);
+}
+
+/* Makes room for len more bytes of text in the newest op and returns where
+ * they go, at the start of its text or at the end. */
+static char *grow(size_t len, int at_start) {
+  size_t size = OP_SIZE(op_at(hist.last)->len + len);
+  hist.end = hist.cur;
+  reserve(size - op_at(hist.last)->size);
+  struct undo_op *op = op_at(hist.last);
+  char *text = OP_TEXT(op);
+  if (at_start) {
+    memmove(text + len, text, op->len);
+  }
+  op->size = size;
+  op->len += len;
+  hist.cur = hist.end = hist.last + size;
+  hist.fresh = 0;
+  hist.logged = now_ms();
+  return at_start ? text : text + op->len - len;
+}
+
+static void copy_row(erow *row, ssize_t at, ssize_t len, char *dst) {
+  if (row->chars) {
+    row_copy(row, at, len, dst);
+  } else {
+    memcpy(dst, row->src + at, len);
+  }
+}
+
+void undo_begin() { hist.fresh = 1; }
+
+void undo_clear() {
+  free(hist.buf);
+  hist.buf = NULL;
+  hist.cap = 0;
+  hist.head = hist.cur = hist.end = 0;
+  hist.fresh = 1;
+}
+
+void undo_insert_text(erow *row, ssize_t at, const char *s, ssize_t len) {
+  if (hist.replaying || len == 0) {
+    return;
+  }
+  int r = row_index(row);
+  struct undo_op *op = mergeable(OP_INSERT_TEXT, len);
+  if (op && ends_word(s[0], OP_TEXT(op)[op->len - 1])) {
+    op = NULL;
+  }
+  if (op && op->row == r && (size_t)op->col + op->len == (size_t)at) {
+    memcpy(grow(len, 0), s, len);
+  } else {
+    op = add_op(OP_INSERT_TEXT, r, at, len);
+    memcpy(OP_TEXT(op), s, len);
+  }
+  fit();
+}
+
+void undo_delete_text(erow *row, ssize_t at, ssize_t len) {
+  if (hist.replaying || len == 0) {
+    return;
+  }
+  int r = row_index(row);
+  struct undo_op *op = mergeable(OP_DELETE_TEXT, len);
+  char c;
+  copy_row(row, at, 1, &c);
+  if (op && ends_word(c, OP_TEXT(op)[op->col == at ? op->len - 1 : 0])) {
+    op = NULL;
+  }
+  if (op && op->row == r && op->col == at + len) {
+    // Backspacing over the bytes before the last deletion
+    op->col = at;
+    copy_row(row, at, len, grow(len, 1));
+  } else if (op && op->row == r && op->col == at) {
+    copy_row(row, at, len, grow(len, 0));
+  } else {
+    op = add_op(OP_DELETE_TEXT, r, at, len);
+    copy_row(row, at, len, OP_TEXT(op));
+  }
+  fit();
+}
+
+void undo_insert_rows(int at, const char *text, size_t len, int n) {
+  if (hist.replaying) {
+    return;
+  }
+  struct undo_op *op = mergeable(OP_INSERT_ROWS, n);
+  char *dst;
+  if (op && op->row + op->nrows == at) {
+    dst = grow(len + 1, 0);
+  } else {
+    op = add_op(OP_INSERT_ROWS, at, 0, len + 1);
+    dst = OP_TEXT(op);
+  }
+  memcpy(dst, text, len);
+  dst[len] = '\n';
+  op_at(hist.last)->nrows += n;
+  fit();
+}
+
+void undo_delete_rows(int at, int n) {
+  if (hist.replaying) {
+    return;
+  }
+  size_t len = 0;
+  erow *row = row_at(at);
+  for (int i = 0; i < n; i++, row = row_next(row)) {
+    len += row->size + 1;
+  }
+  struct undo_op *op = mergeable(OP_DELETE_ROWS, n);
+  char *dst;
+  if (op && op->row == at) {
+    dst = grow(len, 0);
+  } else if (op && op->row == at + n) {
+    op->row = at;
+    dst = grow(len, 1);
+  } else {
+    op = add_op(OP_DELETE_ROWS, at, 0, len);
+    dst = OP_TEXT(op);
+  }
+  row = row_at(at);
+  for (int i = 0; i < n; i++, row = row_next(row)) {
+    copy_row(row, 0, row->size, dst);
+    dst += row->size;
+    *dst++ = '\n';
+  }
+  op_at(hist.last)->nrows += n;
+  fit();
+}
+
+static void apply(struct undo_op *op, int insert) {
+  switch (op->type) {
+  case OP_INSERT_TEXT:
+  case OP_DELETE_TEXT: {
+    erow *row = row_at(op->row);
+    if (insert) {
+      row_insert_text(row, op->col, OP_TEXT(op), op->len);
+    } else {
+      row_delete_text(row, op->col, op->len);
+    }
+    E.cx = op->col + (insert ? op->len : 0);
+  } break;
+  default:
+    if (insert) {
+      insert_rows(op->row, OP_TEXT(op), op->len - 1);
+    } else {
+      delete_rows(op->row, op->nrows);
+    }
+    E.cx = 0;
+  }
+  E.cy = op->row;
+}
+
+void undo() {
+  if (hist.cur == hist.head) {
+    set_status_message("Nothing to undo");
+    return;
+  }
+  hist.replaying = 1;
+  unsigned long group = op_at(hist.last)->group;
+  while (hist.cur > hist.head && op_at(hist.last)->group == group) {
+    struct undo_op *op = op_at(hist.last);
+    apply(op, op->type == OP_DELETE_TEXT || op->type == OP_DELETE_ROWS);
+    hist.cur = hist.last;
+    hist.last -= op->prev;
+  }
+  hist.replaying = 0;
+  hist.fresh = 1;
+}
+
+void redo() {
+  if (hist.cur == hist.end) {
+    set_status_message("Nothing to redo");
+    return;
+  }
+  hist.replaying = 1;
+  unsigned long group = op_at(hist.cur)->group;
+  while (hist.cur < hist.end && op_at(hist.cur)->group == group) {
+    struct undo_op *op = op_at(hist.cur);
+    apply(op, op->type == OP_INSERT_TEXT || op->type == OP_INSERT_ROWS);
+    hist.last = hist.cur;
+    hist.cur += op->size;
+  }
+  hist.replaying = 0;
+  hist.fresh = 1;
+}
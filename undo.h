@@ -0,0 +1,29 @@
+#ifndef UNDO
+#define UNDO
+
+#include "editor.h"
+
+/* Edits are logged as ops holding the text they inserted or deleted, packed
+ * back to back in one arena. Typing and deleting next to the previous edit
+ * extends the op before it, up to the end of a word or a pause in typing,
+ * and all ops made while handling one key form a group that is undone as a
+ * unit. */
+
+// History past this many bytes is dropped, oldest group first. The newest
+// group is kept whole however large it is, so a huge paste can be undone.
+#ifndef UNDO_MAX_BYTES
+#define UNDO_MAX_BYTES (64 << 20)
+#endif
+// Typing after this long a pause starts a new group
+#define UNDO_PAUSE_MS 1000
+
+void undo_begin();
+void undo_clear();
+void undo_insert_text(erow *row, ssize_t at, const char *s, ssize_t len);
+void undo_delete_text(erow *row, ssize_t at, ssize_t len);
+void undo_insert_rows(int at, const char *text, size_t len, int n);
+void undo_delete_rows(int at, int n);
+void undo();
+void redo();
+
+#endif
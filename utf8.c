@@ -0,0 +1,158 @@
+#include "utf8.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct range {
+  int first, last;
+};
+
+// Characters drawn over the one before them
+static const struct range zero_width[] = {
+    {0x0300, 0x036f},   {0x0483, 0x0489},   {0x0591, 0x05bd},
+    {0x05bf, 0x05bf},   {0x05c1, 0x05c2},   {0x05c4, 0x05c5},
+    {0x05c7, 0x05c7},   {0x0610, 0x061a},   {0x064b, 0x065f},
+    {0x0670, 0x0670},   {0x06d6, 0x06dc},   {0x06df, 0x06e4},
+    {0x06e7, 0x06e8},   {0x06ea, 0x06ed},   {0x0711, 0x0711},
+    {0x0730, 0x074a},   {0x07a6, 0x07b0},   {0x07eb, 0x07f3},
+    {0x0816, 0x082d},   {0x0859, 0x085b},   {0x08d3, 0x0902},
+    {0x093a, 0x093a},   {0x093c, 0x093c},   {0x0941, 0x0948},
+    {0x094d, 0x094d},   {0x0951, 0x0957},   {0x0962, 0x0963},
+    {0x0981, 0x0981},   {0x09bc, 0x09bc},   {0x09c1, 0x09c4},
+    {0x09cd, 0x09cd},   {0x09e2, 0x09e3},   {0x0a01, 0x0a02},
+    {0x0a3c, 0x0a3c},   {0x0a41, 0x0a51},   {0x0a70, 0x0a71},
+    {0x0a81, 0x0a82},   {0x0abc, 0x0abc},   {0x0ac1, 0x0ac8},
+    {0x0acd, 0x0acd},   {0x0b01, 0x0b01},   {0x0b3c, 0x0b3c},
+    {0x0b3f, 0x0b3f},   {0x0b41, 0x0b44},   {0x0b4d, 0x0b4d},
+    {0x0bc0, 0x0bc0},   {0x0bcd, 0x0bcd},   {0x0c3e, 0x0c40},
+    {0x0c46, 0x0c56},   {0x0cbc, 0x0cbc},   {0x0ccc, 0x0ccd},
+    {0x0d41, 0x0d44},   {0x0d4d, 0x0d4d},   {0x0dca, 0x0dca},
+    {0x0dd2, 0x0dd6},   {0x0e31, 0x0e31},   {0x0e34, 0x0e3a},
+    {0x0e47, 0x0e4e},   {0x0eb1, 0x0eb1},   {0x0eb4, 0x0ebc},
+    {0x0ec8, 0x0ecd},   {0x0f18, 0x0f19},   {0x0f35, 0x0f39},
+    {0x0f71, 0x0f84},   {0x0f86, 0x0f87},   {0x0f8d, 0x0fbc},
+    {0x102d, 0x1030},   {0x1032, 0x1037},   {0x1039, 0x103a},
+    {0x1160, 0x11ff},   {0x135d, 0x135f},   {0x1712, 0x1714},
+    {0x17b4, 0x17b5},   {0x17b7, 0x17bd},   {0x17c6, 0x17c6},
+    {0x17c9, 0x17d3},   {0x180b, 0x180e},   {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff},   {0x200b, 0x200f},   {0x202a, 0x202e},
+    {0x2060, 0x2064},   {0x20d0, 0x20f0},   {0x2cef, 0x2cf1},
+    {0x2de0, 0x2dff},   {0x302a, 0x302d},   {0x3099, 0x309a},
+    {0xa66f, 0xa672},   {0xa674, 0xa67d},   {0xa69e, 0xa69f},
+    {0xfb1e, 0xfb1e},   {0xfe00, 0xfe0f},   {0xfe20, 0xfe2f},
+    {0xfeff, 0xfeff},   {0x1d167, 0x1d169}, {0x1d173, 0x1d182},
+    {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0xe0001, 0xe007f},
+    {0xe0100, 0xe01ef},
+};
+
+// Characters two columns wide
+static const struct range wide[] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},
+    {0x23e9, 0x23ec},   {0x23f0, 0x23f0},   {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267f, 0x267f},   {0x2693, 0x2693},   {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3},   {0x26f5, 0x26f5},   {0x26fa, 0x26fa},
+    {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},
+    {0x2728, 0x2728},   {0x274c, 0x274c},   {0x274e, 0x274e},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},
+    {0x2b50, 0x2b50},   {0x2b55, 0x2b55},   {0x2e80, 0x303e},
+    {0x3041, 0x3247},   {0x3250, 0x4dbf},   {0x4e00, 0xa4cf},
+    {0xa960, 0xa97f},   {0xac00, 0xd7a3},   {0xf900, 0xfaff},
+    {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},   {0xff00, 0xff60},
+    {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4}, {0x17000, 0x18cff},
+    {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+    {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb},
+    {0x1f90c, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd},
+};
+
+static int in_table(const struct range *t, int n, int cp) {
+  if (cp < t[0].first || cp > t[n - 1].last) {
+    return 0;
+  }
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp > t[mid].last) {
+      lo = mid + 1;
+    } else if (cp < t[mid].first) {
+      hi = mid - 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Decodes the character at s, of at most len bytes. Returns its length, or 0
+ * if s does not start a well-formed sequence. */
+int utf8_decode(const char *s, ssize_t len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  if (len <= 0) {
+    return 0;
+  }
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+  int n, c, min;
+  if (u[0] >= 0xc2 && u[0] <= 0xdf) {
+    n = 2, c = u[0] & 0x1f, min = 0x80;
+  } else if (u[0] >= 0xe0 && u[0] <= 0xef) {
+    n = 3, c = u[0] & 0x0f, min = 0x800;
+  } else if (u[0] >= 0xf0 && u[0] <= 0xf4) {
+    n = 4, c = u[0] & 0x07, min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (len < n) {
+    return 0;
+  }
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    c = c << 6 | (u[i] & 0x3f);
+  }
+  // Overlong forms, surrogates and code points past U+10FFFF
+  if (c < min || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff) {
+    return 0;
+  }
+  *cp = c;
+  return n;
+}
+
+int utf8_width(int cp) {
+  if (in_table(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp)) {
+    return 0;
+  }
+  if (in_table(wide, sizeof(wide) / sizeof(wide[0]), cp)) {
+    return 2;
+  }
+  return 1;
+}
+
+/* Tells if every byte of s takes one column: it is ASCII and holds no tab. */
+int utf8_one_column(const char *s, ssize_t len) {
+  ssize_t i = 0;
+#ifdef __SSE2__
+  __m128i tab = _mm_set1_epi8('\t');
+  for (; len - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+    // The top bit marks non-ASCII bytes, and so does a tab once matched
+    if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)))) {
+      return 0;
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    if ((unsigned char)s[i] >= 0x80 || s[i] == '\t') {
+      return 0;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef UTF8
+#define UTF8
+
+#include <sys/types.h>
+
+/* UTF-8 decoding and the number of terminal columns a character takes. The
+ * width table covers combining marks of the common scripts and the wide East
+ * Asian and emoji blocks, which is what terminals agree on. */
+
+int utf8_decode(const char *s, ssize_t len, int *cp);
+int utf8_width(int cp);
+int utf8_one_column(const char *s, ssize_t len);
+
+#endif
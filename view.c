@@ -0,0 +1,90 @@
+#include "view.h"
+#include "utf8.h"
+
+static struct {
+  struct row_view *first, *last;
+  int n;
+} views;
+
+static void unlink_view(struct row_view *v) {
+  if (v->prev) {
+    v->prev->next = v->next;
+  } else {
+    views.first = v->next;
+  }
+  if (v->next) {
+    v->next->prev = v->prev;
+  } else {
+    views.last = v->prev;
+  }
+}
+
+static void push_front(struct row_view *v) {
+  v->prev = NULL;
+  v->next = views.first;
+  if (views.first) {
+    views.first->prev = v;
+  } else {
+    views.last = v;
+  }
+  views.first = v;
+}
+
+/* Returns the view of row, making it the most recently shown. A new view has
+ * no highlighting yet, so the row is marked for lexing. */
+struct row_view *view_get(erow *row) {
+  struct row_view *v = row->view;
+  if (v) {
+    if (v != views.first) {
+      unlink_view(v);
+      push_front(v);
+    }
+    return v;
+  }
+  v = calloc(1, sizeof(struct row_view));
+  if (v == NULL) {
+    die("calloc");
+  }
+  v->row = row;
+  v->plain = utf8_one_column(ROW_TEXT(row), row->size);
+  push_front(v);
+  views.n++;
+  row->view = v;
+  row->hl_gen = 0;
+  return v;
+}
+
+/* Makes room for the highlighting of len bytes. */
+void view_reserve(struct row_view *v, ssize_t len) {
+  if (v->hl_cap >= len) {
+    return;
+  }
+  ssize_t cap = v->hl_cap * 2 > len ? v->hl_cap * 2 : len;
+  v->hl = realloc(v->hl, cap);
+  if (v->hl == NULL) {
+    die("realloc");
+  }
+  v->hl_cap = cap;
+}
+
+void view_free(erow *row) {
+  struct row_view *v = row->view;
+  if (v == NULL) {
+    return;
+  }
+  unlink_view(v);
+  views.n--;
+  free(v->hl);
+  free(v->hl_ckpt);
+  free(v->rx_ckpt);
+  free(v);
+  row->view = NULL;
+}
+
+/* Drops the views of the least recently shown rows beyond VIEW_MAX_ROWS. Their
+ * comment state is kept, so rows below them need no lexing again. */
+void view_trim() {
+  while (views.n > VIEW_MAX_ROWS) {
+    view_free(views.last->row);
+  }
+}
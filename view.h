@@ -0,0 +1,31 @@
+#ifndef VIEW
+#define VIEW
+
+#include "editor.h"
+
+/* Rows that are shown get a view: their highlighting and the checkpoints that
+ * keep lexing and column mapping fast on long rows. Views of rows that have
+ * not been shown for a while are dropped, so their memory stays bounded
+ * however much of a file is scrolled through. */
+
+// Views kept before the least recently shown ones are dropped
+#define VIEW_MAX_ROWS 4096
+
+struct row_view {
+  erow *row;
+  struct row_view *prev, *next; // most recently shown first
+  unsigned char *hl;
+  ssize_t hl_cap;
+  int plain; // every byte takes one column
+  struct hl_checkpoint *hl_ckpt;
+  ssize_t hl_nckpt, hl_ckpt_cap;
+  ssize_t *rx_ckpt; // column of every RX_STRIDE-th byte, rx_nckpt known
+  ssize_t rx_nckpt, rx_ckpt_cap;
+};
+
+struct row_view *view_get(erow *row);
+void view_reserve(struct row_view *v, ssize_t len);
+void view_free(erow *row);
+void view_trim();
+
+#endif